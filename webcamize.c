@@ -5,11 +5,21 @@
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -27,6 +37,15 @@
 #include <libavutil/opt.h>
 #include <libswscale/swscale.h>
 
+#if defined(USE_LIBJPEG)
+    #include <jpeglib.h>
+    #include <setjmp.h>
+    // Region decoding needs jpeg_crop_scanline and jpeg_skip_scanlines, which only libjpeg-turbo has
+    #if !defined(LIBJPEG_TURBO_VERSION)
+        #undef USE_LIBJPEG
+    #endif
+#endif
+
 #if defined(_WIN32) || defined(_WIN64) || defined(__WIN32__) || defined(__WINDOWS__)
     #define OS_WINDOWS
 #elif defined(__APPLE__) && defined(__MACH__)
@@ -40,24 +59,585 @@ LogLevel log_level = LOG_LEVEL_INFO;
 bool colors_enabled = true;
 
 int file_sink = -1;
+int file_sink_flags = -1;  // as found, to be restored on exit
 int width = 640;
 int height = 480;
 long target_fps = 60;
 bool no_convert = false;
+// --gray outputs luma only, as GREY or as YUYV with neutral chroma for apps that only take YUYV
+typedef enum { GRAY_OFF, GRAY_GREY, GRAY_YUYV } GrayMode;
+GrayMode gray_mode = GRAY_OFF;
+// --on-resize: when the preview size changes, scale frames to the size consumers were given or renegotiate it
+typedef enum { RESIZE_RESCALE, RESIZE_RENEGOTIATE } ResizePolicy;
+ResizePolicy resize_policy = RESIZE_RESCALE;
+int locked_width = 0;  // output size consumers were given, 0 until the first frame
+int locked_height = 0;
+// --output-policy: what happens to a frame when a sink isn't ready for it
+typedef enum { OUTPUT_DROP, OUTPUT_REPLACE, OUTPUT_BLOCK } OutputPolicy;
+OutputPolicy output_policy = OUTPUT_BLOCK;
+int output_deadline_ms = 0;  // how long OUTPUT_BLOCK waits, 0 for one frame at --fps
+bool pull_mode = false;      // --pull: capture on a thread and only decode the newest preview when a frame is due
+bool phase_lock = false;     // --phase-lock: time captures so frames are ready just before each output tick
+bool steady_output = false;  // --steady: emit at exactly --fps, repeating the last frame when nothing new came in
 char camera_model[32] = "";
+const char* trace_record_path = NULL;
+
+// Log calls only format their message on the calling thread; the write to stderr happens on a background thread
+// that drains one lock-free ring per producing thread. Every call site is rate limited to LOG_BURST messages per
+// second, with the number of suppressed repeats appended to the next message that gets through. Fatal messages
+// and anything logged while the logger isn't running are written synchronously and never suppressed, since nothing
+// would report what was left out.
+typedef struct LogSite {
+    const char* pattern;
+    _Atomic uint64_t window_start;
+    _Atomic uint32_t emitted;
+    _Atomic uint32_t suppressed;
+    atomic_flag registered;
+    struct LogSite* next;
+} LogSite;
+
+void log_submit(LogSite* site, LogLevel level, const char* format, ...) __attribute__((format(printf, 3, 4)));
 
-#define log(color, name, format, ...)                                                        \
-    fprintf(stderr, "webcamize: %s [" name "] %s " format "\n", colors_enabled ? color : "", \
-            colors_enabled ? "\e[0m" : "", ##__VA_ARGS__)
+#define log(level, format, ...)                                   \
+    do {                                                          \
+        static LogSite log_site = {.pattern = format};            \
+        log_submit(&log_site, level, format, ##__VA_ARGS__);      \
+    } while (0)
 #define log_debug(format, ...) \
-    if (log_level <= LOG_LEVEL_DEBUG) log("\e[0;106m", "DBUG", format, ##__VA_ARGS__)
+    if (log_level <= LOG_LEVEL_DEBUG) log(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
 #define log_info(format, ...) \
-    if (log_level <= LOG_LEVEL_INFO) log("\e[0;102m", "INFO", format, ##__VA_ARGS__)
+    if (log_level <= LOG_LEVEL_INFO) log(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
 #define log_warn(format, ...) \
-    if (log_level <= LOG_LEVEL_WARN) log("\e[0;105m", "WARN", format, ##__VA_ARGS__)
-#define log_fatal(format, ...) log("\e[0;101m", "FATL", format, ##__VA_ARGS__)
+    if (log_level <= LOG_LEVEL_WARN) log(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define log_fatal(format, ...) log(LOG_LEVEL_FATAL, format, ##__VA_ARGS__)
 #define COPYRIGHT_LINE "Webcamize " VERSION ", copyright (c) " AUTHOR " " YEAR ", licensed " LICENSE "\n"
 
+#define LOG_RING_SLOTS 256
+#define LOG_MESSAGE_SIZE 240
+#define LOG_MAX_THREADS 16
+#define LOG_BURST 10
+#define LOG_WINDOW_NS 1000000000ULL
+
+typedef struct {
+    LogLevel level;
+    char text[LOG_MESSAGE_SIZE];
+} LogEntry;
+
+// Single producer (the owning thread), single consumer (whoever holds logger.drain_lock)
+typedef struct {
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic uint32_t dropped;
+    LogEntry entries[LOG_RING_SLOTS];
+} LogRing;
+
+struct {
+    _Atomic(LogRing*) rings[LOG_MAX_THREADS];
+    _Atomic int nb_rings;
+    _Atomic(LogSite*) sites;
+    _Atomic bool wakeup_pending;
+    atomic_bool running;
+    int wakeup_pipe[2];
+    pthread_t thread;
+    pthread_mutex_t drain_lock;
+} logger = {.wakeup_pipe = {-1, -1}, .drain_lock = PTHREAD_MUTEX_INITIALIZER};
+
+_Thread_local LogRing* log_ring = NULL;
+
+const char* log_colors[] = {"\e[0;106m", "\e[0;102m", "\e[0;105m", "\e[0;101m"};
+const char* log_names[] = {"DBUG", "INFO", "WARN", "FATL"};
+
+int log_prefix(char* buffer, size_t size, LogLevel level) {
+    return snprintf(buffer, size, "webcamize: %s [%s] %s ", colors_enabled ? log_colors[level] : "", log_names[level],
+                    colors_enabled ? "\e[0m" : "");
+}
+
+bool log_rate_check(LogSite* site, uint32_t* suppressed) {
+    if (!atomic_flag_test_and_set(&site->registered)) {
+        site->next = atomic_load(&logger.sites);
+        while (!atomic_compare_exchange_weak(&logger.sites, &site->next, site));
+    }
+
+    struct timespec now;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    uint64_t window_start = atomic_load_explicit(&site->window_start, memory_order_relaxed);
+    if (now_ns - window_start >= LOG_WINDOW_NS
+        && atomic_compare_exchange_strong(&site->window_start, &window_start, now_ns)) {
+        atomic_store(&site->emitted, 0);
+        *suppressed = atomic_exchange(&site->suppressed, 0);
+    }
+
+    if (atomic_fetch_add_explicit(&site->emitted, 1, memory_order_relaxed) < LOG_BURST) return true;
+    atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+    return false;
+}
+
+void log_drain(void) {
+    char buffer[16384];
+    size_t used = 0;
+
+    pthread_mutex_lock(&logger.drain_lock);
+    int nb_rings = atomic_load(&logger.nb_rings);
+    for (int i = 0; i < nb_rings && i < LOG_MAX_THREADS; i++) {
+        LogRing* ring = atomic_load_explicit(&logger.rings[i], memory_order_acquire);
+        if (!ring) continue;
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            const LogEntry* entry = &ring->entries[tail % LOG_RING_SLOTS];
+            if (used + LOG_MESSAGE_SIZE + 64 > sizeof(buffer)) {
+                if (write(STDERR_FILENO, buffer, used) < 0) break;
+                used = 0;
+            }
+            used += log_prefix(buffer + used, sizeof(buffer) - used, entry->level);
+            used += snprintf(buffer + used, sizeof(buffer) - used, "%s\n", entry->text);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint32_t dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped && used + 128 > sizeof(buffer)) {
+            if (write(STDERR_FILENO, buffer, used) >= 0) used = 0;
+        }
+        if (dropped && used + 128 <= sizeof(buffer)) {
+            used += log_prefix(buffer + used, sizeof(buffer) - used, LOG_LEVEL_WARN);
+            used += snprintf(buffer + used, sizeof(buffer) - used, "Log ring overflowed, %u messages dropped\n",
+                             dropped);
+        }
+    }
+    if (used && write(STDERR_FILENO, buffer, used) < 0) {
+        // Nowhere left to report this
+    }
+    pthread_mutex_unlock(&logger.drain_lock);
+}
+
+void* log_thread(void* arg) {
+    (void)arg;
+    struct pollfd pfd = {.fd = logger.wakeup_pipe[0], .events = POLLIN};
+    char discard[64];
+
+    while (atomic_load(&logger.running)) {
+        if (poll(&pfd, 1, 250) > 0) {
+            while (read(logger.wakeup_pipe[0], discard, sizeof(discard)) > 0);
+        }
+        atomic_store(&logger.wakeup_pending, false);
+        log_drain();
+    }
+    return NULL;
+}
+
+LogRing* log_register_thread(void) {
+    int index = atomic_fetch_add(&logger.nb_rings, 1);
+    if (index >= LOG_MAX_THREADS) return NULL;
+    LogRing* ring = calloc(1, sizeof(LogRing));
+    atomic_store_explicit(&logger.rings[index], ring, memory_order_release);
+    log_ring = ring;
+    return ring;
+}
+
+void log_write_now(LogLevel level, const char* format, va_list args, uint32_t suppressed) {
+    char prefix[64];
+    log_prefix(prefix, sizeof(prefix), level);
+    fputs(prefix, stderr);
+    vfprintf(stderr, format, args);
+    if (suppressed) fprintf(stderr, " [repeated %u times]", suppressed);
+    fputc('\n', stderr);
+}
+
+void log_submit(LogSite* site, LogLevel level, const char* format, ...) {
+    uint32_t suppressed = 0;
+    if (level != LOG_LEVEL_FATAL && atomic_load(&logger.running) && !log_rate_check(site, &suppressed)) return;
+
+    va_list args;
+    va_start(args, format);
+    LogRing* ring = log_ring;
+    if (!ring && atomic_load(&logger.running)) ring = log_register_thread();
+
+    if (!ring || !atomic_load(&logger.running) || level == LOG_LEVEL_FATAL) {
+        // Keep fatal messages in order with anything still queued
+        if (atomic_load(&logger.running)) log_drain();
+        log_write_now(level, format, args, suppressed);
+        va_end(args);
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SLOTS) {
+        atomic_fetch_add(&ring->dropped, 1);
+        va_end(args);
+        return;
+    }
+    LogEntry* entry = &ring->entries[head % LOG_RING_SLOTS];
+    entry->level = level;
+    int n = vsnprintf(entry->text, sizeof(entry->text), format, args);
+    va_end(args);
+    if (suppressed && n >= 0 && n < (int)sizeof(entry->text)) {
+        snprintf(entry->text + n, sizeof(entry->text) - n, " [repeated %u times]", suppressed);
+    }
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    if (!atomic_exchange(&logger.wakeup_pending, true)) {
+        if (write(logger.wakeup_pipe[1], "", 1) < 0) {
+            // The pipe is full, so the drainer is already due to wake up
+        }
+    }
+}
+
+int start_logger(void) {
+    if (pipe(logger.wakeup_pipe) < 0) return -1;
+    fcntl(logger.wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(logger.wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+
+    atomic_store(&logger.running, true);
+    if (pthread_create(&logger.thread, NULL, log_thread, NULL) != 0) {
+        atomic_store(&logger.running, false);
+        return -1;
+    }
+    return 0;
+}
+
+void stop_logger(void) {
+    if (!atomic_load(&logger.running)) return;
+    atomic_store(&logger.running, false);
+    if (write(logger.wakeup_pipe[1], "", 1) < 0) {
+        // Ignored, the drainer polls with a timeout anyway
+    }
+    pthread_join(logger.thread, NULL);
+    log_drain();
+
+    for (LogSite* site = atomic_load(&logger.sites); site; site = site->next) {
+        uint32_t suppressed = atomic_exchange(&site->suppressed, 0);
+        if (suppressed) {
+            char prefix[64];
+            log_prefix(prefix, sizeof(prefix), LOG_LEVEL_INFO);
+            fprintf(stderr, "%sSuppressed %u repeats of \"%s\"\n", prefix, suppressed, site->pattern);
+        }
+    }
+
+    close(logger.wakeup_pipe[0]);
+    close(logger.wakeup_pipe[1]);
+    for (int i = 0; i < LOG_MAX_THREADS; i++) {
+        free(atomic_exchange(&logger.rings[i], NULL));
+    }
+    log_ring = NULL;
+}
+
+// Allocation audit builds (`make audit`, or `make audit-run` to replay a trace) interpose the allocator and count
+// every allocation made while a frame goes through the pipeline. Once the pipeline has warmed up, any allocation
+// makes webcamize exit with an error, with those of ALLOC_AUDIT_LARGE bytes or more reported apart from smaller ones.
+// The exception is AVBufferRef-sized allocations: libavutil allocates one for every reference taken on a buffer, and
+// the decoder takes one on each packet and frame, so those are only counted. Capture is audited separately because
+// gphoto2 allocates inside it.
+#define ALLOC_AUDIT_WARMUP_FRAMES 30
+#define ALLOC_AUDIT_LARGE 4096
+
+#if defined(ALLOC_AUDIT) && defined(__GLIBC__)
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* ptr);
+
+struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t large;
+    _Atomic uint64_t refs;
+    _Atomic uint64_t bytes;
+    uint64_t frames;
+    uint64_t steady_count;
+    uint64_t steady_large;
+    uint64_t steady_refs;
+    uint64_t steady_bytes;
+    uint64_t capture_count;
+} alloc_audit = {0};
+
+typedef struct {
+    uint64_t count;
+    uint64_t large;
+    uint64_t refs;
+    uint64_t bytes;
+} AllocSnapshot;
+
+static inline void alloc_audit_count(size_t size) {
+    atomic_fetch_add_explicit(&alloc_audit.count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_audit.bytes, size, memory_order_relaxed);
+    if (size >= ALLOC_AUDIT_LARGE) atomic_fetch_add_explicit(&alloc_audit.large, 1, memory_order_relaxed);
+    if (size == sizeof(AVBufferRef)) atomic_fetch_add_explicit(&alloc_audit.refs, 1, memory_order_relaxed);
+}
+
+void* malloc(size_t size) {
+    alloc_audit_count(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    alloc_audit_count(count * size);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    alloc_audit_count(size);
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    alloc_audit_count(size);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    alloc_audit_count(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    alloc_audit_count(size);
+    void* mem = __libc_memalign(alignment, size);
+    if (!mem) return ENOMEM;
+    *ptr = mem;
+    return 0;
+}
+
+void free(void* ptr) { __libc_free(ptr); }
+
+AllocSnapshot alloc_audit_mark(void) {
+    return (AllocSnapshot){atomic_load(&alloc_audit.count), atomic_load(&alloc_audit.large),
+                           atomic_load(&alloc_audit.refs), atomic_load(&alloc_audit.bytes)};
+}
+
+void alloc_audit_capture(AllocSnapshot mark) {
+    if (alloc_audit.frames >= ALLOC_AUDIT_WARMUP_FRAMES) alloc_audit.capture_count += alloc_audit_mark().count - mark.count;
+}
+
+void alloc_audit_frame(AllocSnapshot mark) {
+    AllocSnapshot now = alloc_audit_mark();
+    if (alloc_audit.frames++ < ALLOC_AUDIT_WARMUP_FRAMES) return;
+
+    alloc_audit.steady_count += now.count - mark.count;
+    alloc_audit.steady_large += now.large - mark.large;
+    alloc_audit.steady_refs += now.refs - mark.refs;
+    alloc_audit.steady_bytes += now.bytes - mark.bytes;
+    uint64_t large = now.large - mark.large;
+    uint64_t small = now.count - mark.count - large - (now.refs - mark.refs);
+    if (large || small) {
+        log_warn("Frame %llu made %llu allocations of %d bytes or more and %llu smaller ones (%llu bytes in total)",
+                 (unsigned long long)alloc_audit.frames, (unsigned long long)large, ALLOC_AUDIT_LARGE,
+                 (unsigned long long)small, (unsigned long long)(now.bytes - mark.bytes));
+    }
+}
+
+// Returns -1 if the steady state made any allocation besides buffer references
+int alloc_audit_report(void) {
+    uint64_t steady_frames = alloc_audit.frames > ALLOC_AUDIT_WARMUP_FRAMES
+                                 ? alloc_audit.frames - ALLOC_AUDIT_WARMUP_FRAMES
+                                 : 0;
+    if (!steady_frames) {
+        log_warn("Allocation audit needs more than %d frames to reach steady state", ALLOC_AUDIT_WARMUP_FRAMES);
+        return 0;
+    }
+    uint64_t steady_small = alloc_audit.steady_count - alloc_audit.steady_large - alloc_audit.steady_refs;
+    log_info("Allocation audit over %llu steady-state frames: %.2f allocations/frame (%.0f bytes/frame), "
+             "%llu large, %llu small, %.2f buffer references/frame, %.2f allocations/frame during capture",
+             (unsigned long long)steady_frames, (double)alloc_audit.steady_count / steady_frames,
+             (double)alloc_audit.steady_bytes / steady_frames, (unsigned long long)alloc_audit.steady_large,
+             (unsigned long long)steady_small, (double)alloc_audit.steady_refs / steady_frames,
+             (double)alloc_audit.capture_count / steady_frames);
+    if (alloc_audit.steady_large || steady_small) {
+        log_fatal("Allocation audit failed: the pipeline allocated after warm-up");
+        return -1;
+    }
+    return 0;
+}
+#else
+typedef struct {
+    char unused;
+} AllocSnapshot;
+
+static inline AllocSnapshot alloc_audit_mark(void) { return (AllocSnapshot){0}; }
+static inline void alloc_audit_capture(AllocSnapshot mark) { (void)mark; }
+static inline void alloc_audit_frame(AllocSnapshot mark) { (void)mark; }
+static inline int alloc_audit_report(void) { return 0; }
+#endif
+
+// Output sinks (the V4L2 device and --file) are non-blocking, so a stalled consumer can't hold up capture. When a sink
+// isn't ready, --output-policy drops the new frame, holds it in place of any frame still waiting, or waits up to a
+// deadline before dropping it. A frame the sink has taken part of is always finished first, since the stream would
+// lose its alignment otherwise. Held frames are finished off while the main loop waits for the next capture.
+typedef struct OutputSink OutputSink;
+struct OutputSink {
+    const char* name;
+    int fd;
+    // Takes up to size bytes without blocking and returns how many it took, 0 if the sink isn't ready or -1 on error
+    int (*send)(OutputSink* sink, const uint8_t* data, int size);
+    struct timespec captured;  // when the frame being sent was captured
+    struct timespec stamp;     // the time the frame being sent is marked with downstream
+    uint8_t* pending;          // copy of a frame still waiting to go out
+    int pending_capacity;
+    int pending_size;
+    int pending_sent;
+    struct timespec pending_captured;
+    struct timespec pending_stamp;
+    unsigned long frames;
+    unsigned long dropped;
+    unsigned long replaced;
+};
+
+int fd_send(OutputSink* sink, const uint8_t* data, int size) {
+    int n = write(sink->fd, data, size);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    return n;
+}
+
+OutputSink file_output = {.name = "file sink", .fd = -1, .send = fd_send};
+
+// How old previews are when their frames go out, from the end of the capture to the end of the write, in 1 ms buckets
+#define FRAME_AGE_BUCKETS 1000
+struct {
+    unsigned long buckets[FRAME_AGE_BUCKETS];  // the last also counts everything older
+    unsigned long count;
+    double total_ms;
+} frame_age = {0};
+
+void record_frame_age(const struct timespec* captured) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = (now.tv_sec - captured->tv_sec) * 1e3 + (now.tv_nsec - captured->tv_nsec) / 1e6;
+    if (ms < 0) ms = 0;
+    frame_age.buckets[ms < FRAME_AGE_BUCKETS ? (int)ms : FRAME_AGE_BUCKETS - 1]++;
+    frame_age.count++;
+    frame_age.total_ms += ms;
+}
+
+void report_frame_age(void) {
+    if (!frame_age.count) return;
+    unsigned long seen = 0;
+    int median = -1, p95 = -1;
+    for (int i = 0; i < FRAME_AGE_BUCKETS && p95 < 0; i++) {
+        seen += frame_age.buckets[i];
+        if (median < 0 && seen * 2 >= frame_age.count) median = i;
+        if (seen * 100 >= frame_age.count * 95) p95 = i;
+    }
+    log_info("Frame age: %.1f ms on average, under %d ms for half of frames and under %d ms for 95%%",
+             frame_age.total_ms / frame_age.count, median + 1, p95 + 1);
+}
+
+// Sends data until the sink stops taking it, waiting for it to become writable until deadline if there is one.
+// Returns the bytes sent or -1.
+int sink_push(OutputSink* sink, const uint8_t* data, int size, const struct timespec* deadline) {
+    int sent = 0;
+    while (sent < size) {
+        int n = sink->send(sink, data + sent, size - sent);
+        if (n < 0) return -1;
+        sent += n;
+        if (n > 0) continue;
+        if (!deadline) break;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left_ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+        if (left_ms <= 0) break;
+        struct pollfd pfd = {.fd = sink->fd, .events = POLLOUT};
+        if (poll(&pfd, 1, left_ms) < 0 && errno != EINTR) return -1;
+    }
+    return sent;
+}
+
+// Keeps a copy of a frame the sink hasn't fully taken yet, sent bytes of which already went out
+int sink_hold(OutputSink* sink, const uint8_t* data, int size, int sent) {
+    if (size > sink->pending_capacity) {
+        av_free(sink->pending);
+        sink->pending = av_malloc(size);
+        sink->pending_capacity = sink->pending ? size : 0;
+        if (!sink->pending) {
+            log_warn("Failed to allocate a held frame for the %s", sink->name);
+            return -1;
+        }
+    }
+    memcpy(sink->pending, data, size);
+    sink->pending_size = size;
+    sink->pending_sent = sent;
+    sink->pending_captured = sink->captured;
+    sink->pending_stamp = sink->stamp;
+    return 0;
+}
+
+// Sends what's left of the held frame, if any. Returns 1 if some of it is still waiting, or -1 if the sink failed.
+int sink_flush(OutputSink* sink, const struct timespec* deadline) {
+    if (!sink->pending_size) return 0;
+    sink->captured = sink->pending_captured;
+    sink->stamp = sink->pending_stamp;
+    int n = sink_push(sink, sink->pending + sink->pending_sent, sink->pending_size - sink->pending_sent, deadline);
+    if (n < 0) return -1;
+    sink->pending_sent += n;
+    if (sink->pending_sent < sink->pending_size) return 1;
+    sink->frames++;
+    record_frame_age(&sink->captured);
+    sink->pending_size = 0;
+    return 0;
+}
+
+// Offers a frame to a sink under output_policy. Returns -1 only if the sink failed.
+int sink_write(OutputSink* sink,
+               const uint8_t* data,
+               int size,
+               const struct timespec* captured,
+               const struct timespec* stamp) {
+    struct timespec deadline, *wait = NULL;
+    if (output_policy == OUTPUT_BLOCK) {
+        long ms = output_deadline_ms ? output_deadline_ms : target_fps > 0 ? 1000 / target_fps : 100;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += ms / 1000;
+        deadline.tv_nsec += (ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        wait = &deadline;
+    }
+
+    if (sink->pending_size && sink->pending_sent == 0 && output_policy == OUTPUT_REPLACE) {
+        // Nothing of the held frame went out, so this newer one takes its place
+        sink->pending_size = 0;
+        sink->replaced++;
+    }
+    int ret = sink_flush(sink, wait);
+    if (ret < 0) return -1;
+    if (ret > 0) {
+        sink->dropped++;
+        log_debug("The %s is still taking the last frame, dropping this one", sink->name);
+        return 0;
+    }
+
+    sink->captured = *captured;
+    sink->stamp = *stamp;
+    int n = sink_push(sink, data, size, wait);
+    if (n < 0) return -1;
+    if (n == size) {
+        sink->frames++;
+        record_frame_age(&sink->captured);
+        return 0;
+    }
+    if (n == 0 && output_policy != OUTPUT_REPLACE) {
+        sink->dropped++;
+        log_debug("The %s isn't ready, dropping a frame", sink->name);
+        return 0;
+    }
+    return sink_hold(sink, data, size, n);
+}
+
+void sink_report(OutputSink* sink) {
+    if (!sink->frames && !sink->dropped && !sink->replaced) return;
+    log_info("Wrote %lu frames to the %s, dropped %lu and replaced %lu it wasn't ready for", sink->frames, sink->name,
+             sink->dropped, sink->replaced);
+    av_freep(&sink->pending);
+    sink->pending_capacity = 0;
+    sink->pending_size = 0;
+}
+
 #if defined(OS_LINUX)
     #include <linux/loop.h>
     #include <linux/module.h>
@@ -90,9 +670,35 @@ struct v4l2_loopback_config {
 
 int v4l2_dev_num = -1;
 int v4l2_fd = -1;
+int v4l2_width = 0;  // size the device is currently set to
+int v4l2_height = 0;
 char v4l2_dev_path[20] = "\0";
 int v4l2loopback_fd = -1;
 
+// Frames go out through mmap'd buffers where the device allows it, so each carries its capture timestamp and a
+// sequence number. Devices without streaming output get write() and the driver stamps frames as they arrive.
+#define V4L2_BUFFERS 4
+struct {
+    void* start;
+    size_t length;
+} v4l2_buffers[V4L2_BUFFERS];
+int v4l2_buffer_count = 0;
+int v4l2_buffers_queued = 0;  // buffers queued at least once; after that every frame reuses a dequeued one
+bool v4l2_streaming = false;
+uint32_t v4l2_sequence = 0;
+
+int v4l2_send(OutputSink* sink, const uint8_t* data, int size);
+OutputSink v4l2_output = {.name = "V4L2 device", .fd = -1, .send = v4l2_send};
+
+// The output rate is measured and advertised as timeperframe, so consumers don't have to guess it
+#define RATE_SMOOTHING 0.05
+#define RATE_TOLERANCE 0.05
+#define RATE_SETTLE_FRAMES 30
+double v4l2_interval_us = 0;  // smoothed time between frames written
+double v4l2_advertised_us = 0;
+int v4l2_frames_since_advert = 0;
+struct timespec v4l2_last_capture = {0};
+
 int init_v4l2_device(void) {
     int ret;
     if (use_v4l2loopback) {
@@ -155,7 +761,7 @@ int init_v4l2_device(void) {
     log_debug("Initializing V4L2 device: %s", v4l2_dev_path);
 
     // Open the V4L2 device
-    v4l2_fd = open(v4l2_dev_path, O_RDWR, O_NONBLOCK);
+    v4l2_fd = open(v4l2_dev_path, O_RDWR | O_NONBLOCK);
     if (v4l2_fd < 0) {
         log_warn("Failed to open V4L2 device %s: %s", v4l2_dev_path, strerror(errno));
         return -1;
@@ -170,81 +776,2651 @@ int init_v4l2_device(void) {
         return -1;
     }
 
-    // Check if it supports video output
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_OUTPUT)) {
-        log_fatal("Device %s does not support video output", v4l2_dev_path);
-        close(v4l2_fd);
-        v4l2_fd = -1;
-        return -1;
+    // Check if it supports video output
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_OUTPUT)) {
+        log_fatal("Device %s does not support video output", v4l2_dev_path);
+        close(v4l2_fd);
+        v4l2_fd = -1;
+        return -1;
+    }
+
+    v4l2_output.fd = v4l2_fd;
+    log_debug("V4L2 device initialized successfully");
+    return 0;
+}
+
+void stop_v4l2_streaming(void) {
+    if (v4l2_streaming) {
+        int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        ioctl(v4l2_fd, VIDIOC_STREAMOFF, &type);
+        v4l2_streaming = false;
+    }
+    for (int i = 0; i < v4l2_buffer_count; i++) munmap(v4l2_buffers[i].start, v4l2_buffers[i].length);
+    if (v4l2_buffer_count) {
+        struct v4l2_requestbuffers req = {.type = V4L2_BUF_TYPE_VIDEO_OUTPUT, .memory = V4L2_MEMORY_MMAP};
+        ioctl(v4l2_fd, VIDIOC_REQBUFS, &req);
+    }
+    v4l2_buffer_count = 0;
+    v4l2_buffers_queued = 0;
+}
+
+// Maps output buffers for the current format. Returns -1, leaving frames to write(), if the device can't stream.
+int start_v4l2_streaming(void) {
+    struct v4l2_requestbuffers req = {
+        .count = V4L2_BUFFERS,
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
+        .memory = V4L2_MEMORY_MMAP,
+    };
+    if (ioctl(v4l2_fd, VIDIOC_REQBUFS, &req) < 0 || req.count == 0) {
+        log_debug("No streaming output on %s, writing frames instead", v4l2_dev_path);
+        return -1;
+    }
+
+    // Buffers past V4L2_BUFFERS are never queued, so the driver just keeps them idle
+    for (unsigned int i = 0; i < req.count && i < V4L2_BUFFERS; i++) {
+        struct v4l2_buffer buf = {.index = i, .type = V4L2_BUF_TYPE_VIDEO_OUTPUT, .memory = V4L2_MEMORY_MMAP};
+        void* start = MAP_FAILED;
+        if (ioctl(v4l2_fd, VIDIOC_QUERYBUF, &buf) == 0) {
+            start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, v4l2_fd, buf.m.offset);
+        }
+        if (start == MAP_FAILED) {
+            log_debug("Failed to map V4L2 buffer %u, writing frames instead: %s", i, strerror(errno));
+            stop_v4l2_streaming();
+            return -1;
+        }
+        v4l2_buffers[i].start = start;
+        v4l2_buffers[i].length = buf.length;
+        v4l2_buffer_count++;
+    }
+
+    log_debug("Streaming to %s through %d mapped buffers", v4l2_dev_path, v4l2_buffer_count);
+    return 0;
+}
+
+int advertise_v4l2_interval(double interval_us) {
+    struct v4l2_streamparm parm = {.type = V4L2_BUF_TYPE_VIDEO_OUTPUT};
+    parm.parm.output.timeperframe.numerator = (uint32_t)(interval_us + 0.5);
+    parm.parm.output.timeperframe.denominator = 1000000;
+    if (ioctl(v4l2_fd, VIDIOC_S_PARM, &parm) < 0) {
+        log_debug("Could not set the frame interval for %s: %s", v4l2_dev_path, strerror(errno));
+        return -1;
+    }
+    v4l2_advertised_us = interval_us;
+    v4l2_frames_since_advert = 0;
+    log_debug("Advertising %.2f fps on %s", 1e6 / interval_us, v4l2_dev_path);
+    return 0;
+}
+
+// Folds the interval since the last frame into the measured rate and advertises it once it settles somewhere new
+void track_v4l2_rate(const struct timespec* stamp) {
+    if (v4l2_last_capture.tv_sec || v4l2_last_capture.tv_nsec) {
+        double interval = (stamp->tv_sec - v4l2_last_capture.tv_sec) * 1e6
+                          + (stamp->tv_nsec - v4l2_last_capture.tv_nsec) / 1e3;
+        // Stalls, like the decoder tuner holding frames back, aren't the rate
+        if (interval > 0 && interval < 1e6) {
+            v4l2_interval_us = v4l2_interval_us ? v4l2_interval_us + RATE_SMOOTHING * (interval - v4l2_interval_us)
+                                                : interval;
+        }
+    }
+    v4l2_last_capture = *stamp;
+
+    if (++v4l2_frames_since_advert >= RATE_SETTLE_FRAMES && v4l2_interval_us > 0
+        && FFABS(v4l2_interval_us - v4l2_advertised_us) > RATE_TOLERANCE * v4l2_advertised_us) {
+        advertise_v4l2_interval(v4l2_interval_us);
+    }
+}
+
+int setup_v4l2_format(void) {
+    struct v4l2_format fmt;
+
+    // Buffers are sized for the old format, so they go before the format can change
+    stop_v4l2_streaming();
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    int bytes_per_pixel = gray_mode == GRAY_GREY ? 1 : 2;  // YUYV = 2 bytes per pixel, GREY = 1
+    fmt.fmt.pix.pixelformat = gray_mode == GRAY_GREY ? V4L2_PIX_FMT_GREY : V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    fmt.fmt.pix.bytesperline = width * bytes_per_pixel;
+    fmt.fmt.pix.sizeimage = width * height * bytes_per_pixel;
+    // Frames are always packed as limited-range BT.601, JPEG's matrix, so say so and spare consumers from guessing
+    fmt.fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;
+    fmt.fmt.pix.ycbcr_enc = V4L2_YCBCR_ENC_601;
+    fmt.fmt.pix.quantization = V4L2_QUANTIZATION_LIM_RANGE;
+    fmt.fmt.pix.xfer_func = V4L2_XFER_FUNC_709;
+
+    if (ioctl(v4l2_fd, VIDIOC_S_FMT, &fmt) < 0) {
+        log_warn("Could not set format for /dev/video%d: %s", v4l2_dev_num, strerror(errno));
+        // The old format still stands, so carry on streaming in it
+        if (v4l2_width) start_v4l2_streaming();
+        return -1;
+    }
+    v4l2_width = width;
+    v4l2_height = height;
+
+    // Until there's a measured rate, the frame rate limit is the best guess
+    if (!v4l2_advertised_us) advertise_v4l2_interval(1e6 / (target_fps > 0 ? target_fps : 30));
+    start_v4l2_streaming();
+
+    log_debug("V4L2 format set to %dx%d %s, limited-range BT.601", width, height,
+              gray_mode == GRAY_GREY ? "GREY" : "YUYV");
+    return 0;
+}
+
+// Sends a whole frame to the device, with its stamp as the buffer timestamp. Every write() is a frame of its own to the
+// driver, so a short one isn't continued.
+int v4l2_send(OutputSink* sink, const uint8_t* data, int size) {
+    if (!v4l2_buffer_count) {
+        int n = fd_send(sink, data, size);
+        if (n <= 0) return n;
+        if (n != size) log_warn("Short write to V4L2 device: wrote %d of %d bytes", n, size);
+        v4l2_sequence++;
+        track_v4l2_rate(&sink->stamp);
+        return size;
+    }
+
+    struct v4l2_buffer buf = {.type = V4L2_BUF_TYPE_VIDEO_OUTPUT, .memory = V4L2_MEMORY_MMAP};
+    if (v4l2_buffers_queued < v4l2_buffer_count) {
+        buf.index = v4l2_buffers_queued++;
+    } else if (ioctl(v4l2_fd, VIDIOC_DQBUF, &buf) < 0) {
+        if (errno == EAGAIN || errno == EINTR) return 0;
+        log_warn("Failed to dequeue a V4L2 buffer: %s", strerror(errno));
+        return -1;
+    }
+
+    size_t length = v4l2_buffers[buf.index].length;
+    if ((size_t)size > length) log_warn("Short write to V4L2 device: wrote %zu of %d bytes", length, size);
+    memcpy(v4l2_buffers[buf.index].start, data, FFMIN((size_t)size, length));
+    buf.bytesused = FFMIN((size_t)size, length);
+    buf.field = V4L2_FIELD_NONE;
+    buf.timestamp.tv_sec = sink->stamp.tv_sec;
+    buf.timestamp.tv_usec = sink->stamp.tv_nsec / 1000;
+    buf.sequence = v4l2_sequence++;
+    if (ioctl(v4l2_fd, VIDIOC_QBUF, &buf) < 0) {
+        log_warn("Failed to queue a V4L2 buffer: %s", strerror(errno));
+        return -1;
+    }
+
+    if (!v4l2_streaming) {
+        int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        if (ioctl(v4l2_fd, VIDIOC_STREAMON, &type) < 0) {
+            log_warn("Failed to start streaming to V4L2 device: %s", strerror(errno));
+            return -1;
+        }
+        v4l2_streaming = true;
+    }
+    track_v4l2_rate(&sink->stamp);
+    return size;
+}
+#endif
+
+// With --lock-memory, every pipeline buffer (packets, decoded frames and the output frame) comes out of one
+// region that is mapped, advised for transparent huge pages, prefaulted and mlocked at startup. Steady-state
+// frames then never take a page fault or a TLB miss on a freshly mapped page. The region is carved up by a
+// first-fit allocator; anything that doesn't fit falls back to av_malloc.
+#define ARENA_HEADER 64
+#define ARENA_HUGE_PAGE (2 << 20)
+#define ARENA_MAX_MIB 16384
+
+typedef struct ArenaBlock {
+    size_t size;  // usable bytes after the header
+    bool free;
+    struct ArenaBlock* prev;
+    struct ArenaBlock* next;
+} ArenaBlock;
+
+struct {
+    size_t size;
+    uint8_t* base;
+    uint8_t* map;
+    size_t map_size;
+    ArenaBlock* blocks;
+    pthread_mutex_t lock;
+} arena = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+int init_arena(void) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Over-map so the region can start on a huge page boundary
+    arena.map_size = arena.size + ARENA_HUGE_PAGE;
+    arena.map = mmap(NULL, arena.map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena.map == MAP_FAILED) {
+        arena.map = NULL;
+        log_fatal("Failed to map %zu MiB of frame memory: %s", arena.size >> 20, strerror(errno));
+        return -1;
+    }
+    arena.base = (uint8_t*)(((uintptr_t)arena.map + ARENA_HUGE_PAGE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+
+    bool huge_pages = false;
+#if defined(MADV_HUGEPAGE)
+    huge_pages = madvise(arena.base, arena.size, MADV_HUGEPAGE) == 0;
+#endif
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < arena.size; offset += page_size) arena.base[offset] = 0;
+
+    bool locked = mlock(arena.base, arena.size) == 0;
+    if (!locked) log_warn("Failed to lock frame memory, it may still be paged out: %s", strerror(errno));
+
+    arena.blocks = (ArenaBlock*)arena.base;
+    *arena.blocks = (ArenaBlock){.size = arena.size - ARENA_HEADER, .free = true};
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    log_info("Prefaulted%s %zu MiB of frame memory in %.1f ms (transparent huge pages %s)", locked ? " and locked" : "",
+             arena.size >> 20, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+             huge_pages ? "requested" : "unavailable");
+    return 0;
+}
+
+void cleanup_arena(void) {
+    if (!arena.map) return;
+    munlock(arena.base, arena.size);
+    munmap(arena.map, arena.map_size);
+    arena.map = NULL;
+}
+
+bool in_arena(const void* ptr) {
+    return arena.map && (const uint8_t*)ptr >= arena.base && (const uint8_t*)ptr < arena.base + arena.size;
+}
+
+void* pipeline_alloc(size_t size) {
+    if (!arena.map) return av_malloc(size);
+
+    size = (size + ARENA_HEADER - 1) & ~(size_t)(ARENA_HEADER - 1);
+    pthread_mutex_lock(&arena.lock);
+    ArenaBlock* block = arena.blocks;
+    while (block && !(block->free && block->size >= size)) block = block->next;
+    if (block) {
+        // Split off the tail if it is big enough to be worth keeping
+        if (block->size - size >= ARENA_HEADER + 4096) {
+            ArenaBlock* rest = (ArenaBlock*)((uint8_t*)block + ARENA_HEADER + size);
+            *rest = (ArenaBlock){.size = block->size - size - ARENA_HEADER, .free = true, .prev = block,
+                                 .next = block->next};
+            if (block->next) block->next->prev = rest;
+            block->next = rest;
+            block->size = size;
+        }
+        block->free = false;
+    }
+    pthread_mutex_unlock(&arena.lock);
+
+    if (!block) {
+        log_warn("Locked frame memory exhausted, falling back to regular allocations; consider a larger --lock-memory");
+        return av_malloc(size);
+    }
+    return (uint8_t*)block + ARENA_HEADER;
+}
+
+void pipeline_free(void* ptr) {
+    if (!ptr) return;
+    if (!in_arena(ptr)) {
+        av_free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&arena.lock);
+    ArenaBlock* block = (ArenaBlock*)((uint8_t*)ptr - ARENA_HEADER);
+    block->free = true;
+    if (block->next && block->next->free) {
+        block->size += ARENA_HEADER + block->next->size;
+        block->next = block->next->next;
+        if (block->next) block->next->prev = block;
+    }
+    if (block->prev && block->prev->free) {
+        block->prev->size += ARENA_HEADER + block->size;
+        block->prev->next = block->next;
+        if (block->next) block->next->prev = block->prev;
+    }
+    pthread_mutex_unlock(&arena.lock);
+}
+
+void pipeline_buffer_free(void* opaque, uint8_t* data) {
+    (void)opaque;
+    pipeline_free(data);
+}
+
+// av_buffer_pool_init2 switched its size argument to size_t in libavutil 57
+#if LIBAVUTIL_VERSION_MAJOR < 57
+typedef int PoolBufferSize;
+#else
+typedef size_t PoolBufferSize;
+#endif
+
+AVBufferRef* pipeline_buffer_alloc(void* opaque, PoolBufferSize size) {
+    (void)opaque;
+    uint8_t* data = pipeline_alloc(size);
+    if (!data) return NULL;
+    AVBufferRef* buf = av_buffer_create(data, size, pipeline_buffer_free, NULL, 0);
+    if (!buf) pipeline_free(data);
+    return buf;
+}
+
+// Decoder frames come from a pool backed by pipeline memory when --lock-memory is on
+AVBufferPool* decoder_pool = NULL;
+int decoder_pool_size = 0;
+
+int pipeline_get_buffer2(AVCodecContext* ctx, AVFrame* frame, int flags) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+    if (!arena.map || !desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))) {
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+    }
+
+    int w = frame->width;
+    int h = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(ctx, &w, &h, linesize_align);
+
+    int ret = av_image_fill_linesizes(frame->linesize, frame->format, w);
+    if (ret < 0) return ret;
+    for (int i = 0; i < 4; i++) frame->linesize[i] = FFALIGN(frame->linesize[i], 64);
+    int size = av_image_fill_pointers(frame->data, frame->format, h, NULL, frame->linesize);
+    if (size < 0) return size;
+    // Same slack the default allocator leaves for SIMD overreads
+    size += 16 + 64 - 1;
+
+    if (!decoder_pool || size != decoder_pool_size) {
+        av_buffer_pool_uninit(&decoder_pool);
+        decoder_pool = av_buffer_pool_init2(size, NULL, pipeline_buffer_alloc, NULL);
+        if (!decoder_pool) return AVERROR(ENOMEM);
+        decoder_pool_size = size;
+    }
+
+    frame->buf[0] = av_buffer_pool_get(decoder_pool);
+    if (!frame->buf[0]) return AVERROR(ENOMEM);
+    av_image_fill_pointers(frame->data, frame->format, h, frame->buf[0]->data, frame->linesize);
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+// Row kernels shared by the flip and pack stages. The streaming variants use non-temporal stores so that frames
+// which are only read again by the kernel or a consumer on another core don't evict the decoder's working set;
+// callers issue stream_fence() once the whole frame has been written.
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+    #include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#endif
+
+void copy_row(uint8_t* dst, const uint8_t* src, int n) { memcpy(dst, src, n); }
+
+void copy_row_stream(uint8_t* dst, const uint8_t* src, int n) {
+#if defined(__SSE2__)
+    int i = 0;
+    int head = (16 - ((uintptr_t)dst & 15)) & 15;
+    if (head > n) head = n;
+    memcpy(dst, src, head);
+    i = head;
+    #if defined(__AVX2__)
+    if (!((uintptr_t)(dst + i) & 31)) {
+        for (; i + 64 <= n; i += 64) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+            _mm256_stream_si256((__m256i*)(dst + i), a);
+            _mm256_stream_si256((__m256i*)(dst + i + 32), b);
+        }
+    }
+    #endif
+    for (; i + 16 <= n; i += 16) {
+        _mm_stream_si128((__m128i*)(dst + i), _mm_loadu_si128((const __m128i*)(src + i)));
+    }
+    memcpy(dst + i, src + i, n - i);
+#else
+    memcpy(dst, src, n);
+#endif
+}
+
+void stream_fence(void) {
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+// Full (JPEG) range to limited (video) range: Y' = 16 + Y * 219 / 255 and C' = 128 + (C - 128) * 224 / 255. The scales
+// are Q15 so the SIMD path is a single pmulhrsw per 8 samples; the tables round the same way for the scalar tails.
+#define LUMA_RANGE_Q15 28142
+#define CHROMA_RANGE_Q15 28784
+uint8_t luma_range[256];
+uint8_t chroma_range[256];
+bool range_tables_ready = false;
+
+void init_range_tables(void) {
+    for (int i = 0; i < 256; i++) {
+        luma_range[i] = 16 + ((i * LUMA_RANGE_Q15 + (1 << 14)) >> 15);
+        chroma_range[i] = 128 + (((i - 128) * CHROMA_RANGE_Q15 + (1 << 14)) >> 15);
+    }
+    range_tables_ready = true;
+}
+
+#if defined(__SSSE3__)
+static inline __m128i limit_range16(__m128i v, __m128i centre, __m128i offset, __m128i scale) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), centre);
+    __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), centre);
+    lo = _mm_add_epi16(_mm_mulhrs_epi16(lo, scale), offset);
+    hi = _mm_add_epi16(_mm_mulhrs_epi16(hi, scale), offset);
+    return _mm_packus_epi16(lo, hi);
+}
+#endif
+
+#if defined(__SSE2__)
+// Interleaves 32 pixels of luma (y0, y1) and 16 pairs of chroma into 64 bytes of YUYV
+static inline void store_yuyv32(uint8_t* dst,
+                                __m128i y0,
+                                __m128i y1,
+                                __m128i cb,
+                                __m128i cr,
+                                bool full_range,
+                                bool stream) {
+#if defined(__SSSE3__)
+    if (full_range) {
+        y0 = limit_range16(y0, _mm_setzero_si128(), _mm_set1_epi16(16), _mm_set1_epi16(LUMA_RANGE_Q15));
+        y1 = limit_range16(y1, _mm_setzero_si128(), _mm_set1_epi16(16), _mm_set1_epi16(LUMA_RANGE_Q15));
+        cb = limit_range16(cb, _mm_set1_epi16(128), _mm_set1_epi16(128), _mm_set1_epi16(CHROMA_RANGE_Q15));
+        cr = limit_range16(cr, _mm_set1_epi16(128), _mm_set1_epi16(128), _mm_set1_epi16(CHROMA_RANGE_Q15));
+    }
+#else
+    (void)full_range;
+#endif
+    __m128i uv0 = _mm_unpacklo_epi8(cb, cr);
+    __m128i uv1 = _mm_unpackhi_epi8(cb, cr);
+    __m128i out0 = _mm_unpacklo_epi8(y0, uv0);
+    __m128i out1 = _mm_unpackhi_epi8(y0, uv0);
+    __m128i out2 = _mm_unpacklo_epi8(y1, uv1);
+    __m128i out3 = _mm_unpackhi_epi8(y1, uv1);
+    __m128i* out = (__m128i*)dst;
+    if (stream) {
+        _mm_stream_si128(out, out0);
+        _mm_stream_si128(out + 1, out1);
+        _mm_stream_si128(out + 2, out2);
+        _mm_stream_si128(out + 3, out3);
+    } else {
+        _mm_storeu_si128(out, out0);
+        _mm_storeu_si128(out + 1, out1);
+        _mm_storeu_si128(out + 2, out2);
+        _mm_storeu_si128(out + 3, out3);
+    }
+}
+#endif
+
+// Interleaves one row of planar 4:2:x YUV into YUYV, bringing full-range samples into limited range on the way; width
+// must be even
+void pack_yuyv_row(uint8_t* dst,
+                   const uint8_t* y,
+                   const uint8_t* u,
+                   const uint8_t* v,
+                   int width,
+                   bool full_range,
+                   bool stream) {
+    int x = 0;
+#if defined(__SSE2__)
+    // Streaming stores need 16-byte alignment, which rows only have when width * 2 is a multiple of 16
+    stream = stream && !((uintptr_t)dst & 15);
+    #if defined(__SSSE3__)
+    int vector_width = width;
+    #else
+    // Range conversion needs pmulhrsw, so without SSSE3 those rows are left to the tables
+    int vector_width = full_range ? 0 : width;
+    #endif
+    for (; x + 32 <= vector_width; x += 32) {
+        store_yuyv32(dst + x * 2, _mm_loadu_si128((const __m128i*)(y + x)),
+                     _mm_loadu_si128((const __m128i*)(y + x + 16)), _mm_loadu_si128((const __m128i*)(u + x / 2)),
+                     _mm_loadu_si128((const __m128i*)(v + x / 2)), full_range, stream);
+    }
+#else
+    (void)stream;
+#endif
+    if (full_range) {
+        for (; x < width; x += 2) {
+            dst[x * 2] = luma_range[y[x]];
+            dst[x * 2 + 1] = chroma_range[u[x / 2]];
+            dst[x * 2 + 2] = luma_range[y[x + 1]];
+            dst[x * 2 + 3] = chroma_range[v[x / 2]];
+        }
+        return;
+    }
+    for (; x < width; x += 2) {
+        dst[x * 2] = y[x];
+        dst[x * 2 + 1] = u[x / 2];
+        dst[x * 2 + 2] = y[x + 1];
+        dst[x * 2 + 3] = v[x / 2];
+    }
+}
+
+// Same as pack_yuyv_row, but reads the source row right to left
+void pack_yuyv_row_mirror(uint8_t* dst,
+                          const uint8_t* y,
+                          const uint8_t* u,
+                          const uint8_t* v,
+                          int width,
+                          bool full_range,
+                          bool stream) {
+    int x = 0;
+#if defined(__SSSE3__)
+    const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    stream = stream && !((uintptr_t)dst & 15);
+    for (; x + 32 <= width; x += 32) {
+        int cx = (width - x) / 2 - 16;
+        store_yuyv32(dst + x * 2, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(y + width - x - 16)), reverse),
+                     _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(y + width - x - 32)), reverse),
+                     _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(u + cx)), reverse),
+                     _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(v + cx)), reverse), full_range, stream);
+    }
+#else
+    (void)stream;
+#endif
+    if (full_range) {
+        for (; x < width; x += 2) {
+            dst[x * 2] = luma_range[y[width - 1 - x]];
+            dst[x * 2 + 1] = chroma_range[u[(width - x) / 2 - 1]];
+            dst[x * 2 + 2] = luma_range[y[width - 2 - x]];
+            dst[x * 2 + 3] = chroma_range[v[(width - x) / 2 - 1]];
+        }
+        return;
+    }
+    for (; x < width; x += 2) {
+        dst[x * 2] = y[width - 1 - x];
+        dst[x * 2 + 1] = u[(width - x) / 2 - 1];
+        dst[x * 2 + 2] = y[width - 2 - x];
+        dst[x * 2 + 3] = v[(width - x) / 2 - 1];
+    }
+}
+
+// Copies one row of luma, optionally mirrored and brought into limited range; dst may be src when not mirroring
+void copy_luma_row(uint8_t* dst, const uint8_t* src, int width, bool mirror, bool full_range) {
+    int x = 0;
+#if defined(__SSSE3__)
+    const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    for (; x + 16 <= width; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(mirror ? src + width - x - 16 : src + x));
+        if (mirror) v = _mm_shuffle_epi8(v, reverse);
+        if (full_range) v = limit_range16(v, _mm_setzero_si128(), _mm_set1_epi16(16), _mm_set1_epi16(LUMA_RANGE_Q15));
+        _mm_storeu_si128((__m128i*)(dst + x), v);
+    }
+#endif
+    for (; x < width; x++) {
+        uint8_t v = src[mirror ? width - 1 - x : x];
+        dst[x] = full_range ? luma_range[v] : v;
+    }
+}
+
+#if defined(__SSE2__)
+static inline void transpose8x8(uint8_t* dst, int dst_stride, const uint8_t* src, ptrdiff_t src_stride) {
+    __m128i a[8];
+    for (int i = 0; i < 8; i++) a[i] = _mm_loadl_epi64((const __m128i*)(src + i * src_stride));
+
+    // Byte pairs, then words, then dwords: each step doubles the length of the transposed runs
+    __m128i b0 = _mm_unpacklo_epi8(a[0], a[1]);
+    __m128i b1 = _mm_unpacklo_epi8(a[2], a[3]);
+    __m128i b2 = _mm_unpacklo_epi8(a[4], a[5]);
+    __m128i b3 = _mm_unpacklo_epi8(a[6], a[7]);
+    __m128i c0 = _mm_unpacklo_epi16(b0, b1);
+    __m128i c1 = _mm_unpackhi_epi16(b0, b1);
+    __m128i c2 = _mm_unpacklo_epi16(b2, b3);
+    __m128i c3 = _mm_unpackhi_epi16(b2, b3);
+    __m128i d[4] = {_mm_unpacklo_epi32(c0, c2), _mm_unpackhi_epi32(c0, c2), _mm_unpacklo_epi32(c1, c3),
+                    _mm_unpackhi_epi32(c1, c3)};
+
+    for (int i = 0; i < 4; i++) {
+        _mm_storel_epi64((__m128i*)(dst + (2 * i) * dst_stride), d[i]);
+        _mm_storel_epi64((__m128i*)(dst + (2 * i + 1) * dst_stride), _mm_unpackhi_epi64(d[i], d[i]));
+    }
+}
+#endif
+
+// Transposes a w x h block of bytes, so that dst[x * dst_stride + y] = src[y * src_stride + x]
+void transpose_plane(uint8_t* dst, int dst_stride, const uint8_t* src, ptrdiff_t src_stride, int w, int h) {
+    int y = 0;
+#if defined(__SSE2__)
+    for (; y + 8 <= h; y += 8) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            transpose8x8(dst + x * dst_stride + y, dst_stride, src + y * src_stride + x, src_stride);
+        }
+        for (; x < w; x++) {
+            for (int i = 0; i < 8; i++) dst[x * dst_stride + y + i] = src[(y + i) * src_stride + x];
+        }
+    }
+#endif
+    for (; y < h; y++) {
+        for (int x = 0; x < w; x++) dst[x * dst_stride + y] = src[y * src_stride + x];
+    }
+}
+
+// Everything the flip needs to know about a pixel format, worked out once per format and geometry: how many planes
+// carry image rows, how tall each plane is and how many bytes of each row are visible. Chroma planes are
+// whichever planes hold components 1 and 2 of a non-RGB format (U and V, or the interleaved UV plane of NV12);
+// alpha and RGB planes are full height. The palette of PAL8 is not a plane of rows and is passed through.
+typedef struct {
+    int format;
+    int width;
+    int height;
+    int nb_planes;
+    int shift[4];  // vertical subsampling of each plane
+    int heights[4];
+    int row_bytes[4];
+} FlipPlan;
+
+FlipPlan flip_plan = {.format = AV_PIX_FMT_NONE};
+
+int update_flip_plan(int format, int w, int h) {
+    if (flip_plan.format == format && flip_plan.width == w && flip_plan.height == h) return 0;
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) return AVERROR(EINVAL);
+
+    FlipPlan plan = {.format = format, .width = w, .height = h};
+    int ret = av_image_fill_linesizes(plan.row_bytes, format, w);
+    if (ret < 0) return ret;
+    plan.nb_planes = (desc->flags & AV_PIX_FMT_FLAG_PAL) ? 1 : av_pix_fmt_count_planes(format);
+
+    for (int c = 0; c < desc->nb_components; c++) {
+        int plane = desc->comp[c].plane;
+        if ((c == 1 || c == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB)) plan.shift[plane] = desc->log2_chroma_h;
+    }
+    for (int plane = 0; plane < plan.nb_planes; plane++) plan.heights[plane] = AV_CEIL_RSHIFT(h, plan.shift[plane]);
+
+    flip_plan = plan;
+    log_debug("Flip plan for %s %dx%d: %d planes", desc->name, w, h, plan.nb_planes);
+    return 0;
+}
+
+// Makes dst a view of src that starts at each plane's last row and walks upwards
+void flip_view(const FlipPlan* plan, const AVFrame* src, AVFrame* dst) {
+    dst->format = src->format;
+    dst->width = src->width;
+    dst->height = src->height;
+    for (int plane = 0; plane < 4; plane++) {
+        if (plane < plan->nb_planes) {
+            dst->data[plane] = src->data[plane] + (plan->heights[plane] - 1) * src->linesize[plane];
+            dst->linesize[plane] = -src->linesize[plane];
+        } else {
+            dst->data[plane] = src->data[plane];
+            dst->linesize[plane] = src->linesize[plane];
+        }
+    }
+}
+
+// Writes a flipped copy of rows [y0, y0 + rows) of the luma grid, copying only the visible bytes of each row
+void flip_copy(const FlipPlan* plan,
+               uint8_t* const dst_data[4],
+               const int dst_linesize[4],
+               const AVFrame* src,
+               int y0,
+               int rows,
+               bool stream) {
+    void (*copy)(uint8_t*, const uint8_t*, int) = stream ? copy_row_stream : copy_row;
+    for (int plane = 0; plane < plan->nb_planes; plane++) {
+        int first = y0 >> plan->shift[plane];
+        int last = y0 + rows >= plan->height ? plan->heights[plane] : (y0 + rows) >> plan->shift[plane];
+        for (int y = first; y < last; y++) {
+            copy(dst_data[plane] + y * dst_linesize[plane],
+                 src->data[plane] + (plan->heights[plane] - 1 - y) * src->linesize[plane], plan->row_bytes[plane]);
+        }
+    }
+}
+
+#if defined(FLIP_TEST)
+// make test: frames in every format a camera JPEG or raw preview can decode to are filled with a known pattern,
+// flipped through flip_view and flip_copy, and compared byte for byte with the golden flip, which is the same pattern
+// read bottom-up. The geometry of each format is written out here rather than taken from the flip plan, so a plan
+// with a wrong plane height, a missing plane or a short row fails. Odd sizes catch rounding in subsampled planes.
+typedef struct {
+    enum AVPixelFormat format;
+    int nb_planes;
+    struct {
+        int bytes;    // bytes per 1 << shift_x pixels
+        int shift_x;  // horizontal subsampling
+        int shift_y;  // vertical subsampling
+    } planes[4];
+} FlipTestFormat;
+
+#define FLIP_TEST_YUV(f, bytes, sx, sy) {f, 3, {{bytes, 0, 0}, {bytes, sx, sy}, {bytes, sx, sy}}}
+const FlipTestFormat flip_test_formats[] = {
+    FLIP_TEST_YUV(AV_PIX_FMT_YUVJ420P, 1, 1, 1),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUVJ422P, 1, 1, 0),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUVJ444P, 1, 0, 0),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUVJ440P, 1, 0, 1),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUV420P, 1, 1, 1),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUV422P, 1, 1, 0),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUV444P, 1, 0, 0),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUV440P, 1, 0, 1),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUV411P, 1, 2, 0),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUV420P10LE, 2, 1, 1),
+    FLIP_TEST_YUV(AV_PIX_FMT_YUV422P12LE, 2, 1, 0),
+    FLIP_TEST_YUV(AV_PIX_FMT_GBRP, 1, 0, 0),
+    {AV_PIX_FMT_YUVA420P, 4, {{1, 0, 0}, {1, 1, 1}, {1, 1, 1}, {1, 0, 0}}},
+    {AV_PIX_FMT_NV12, 2, {{1, 0, 0}, {2, 1, 1}}},
+    {AV_PIX_FMT_NV21, 2, {{1, 0, 0}, {2, 1, 1}}},
+    {AV_PIX_FMT_P010LE, 2, {{2, 0, 0}, {4, 1, 1}}},
+    {AV_PIX_FMT_YUYV422, 1, {{4, 1, 0}}},
+    {AV_PIX_FMT_UYVY422, 1, {{4, 1, 0}}},
+    {AV_PIX_FMT_GRAY8, 1, {{1, 0, 0}}},
+    {AV_PIX_FMT_GRAY16LE, 1, {{2, 0, 0}}},
+    {AV_PIX_FMT_PAL8, 1, {{1, 0, 0}}},  // the palette isn't a plane of rows
+    {AV_PIX_FMT_RGB24, 1, {{3, 0, 0}}},
+    {AV_PIX_FMT_BGR24, 1, {{3, 0, 0}}},
+    {AV_PIX_FMT_RGBA, 1, {{4, 0, 0}}},
+    {AV_PIX_FMT_BGRA, 1, {{4, 0, 0}}},
+    {AV_PIX_FMT_BGR0, 1, {{4, 0, 0}}},
+    {AV_PIX_FMT_RGB48LE, 1, {{6, 0, 0}}},
+};
+
+#define FLIP_TEST_STRIPE 8
+
+uint8_t flip_test_pattern(int plane, int y, int x) { return plane * 71 + y * 31 + x * 7 + (x >> 3); }
+
+int flip_test_rows(const FlipTestFormat* f, int plane, int h) { return AV_CEIL_RSHIFT(h, f->planes[plane].shift_y); }
+
+int flip_test_row_bytes(const FlipTestFormat* f, int plane, int w) {
+    return AV_CEIL_RSHIFT(w, f->planes[plane].shift_x) * f->planes[plane].bytes;
+}
+
+// Returns the first plane that differs from the golden flip, or -1 if the whole frame matches
+int flip_test_compare(const FlipTestFormat* f, int w, int h, uint8_t* const data[4], const int linesize[4]) {
+    for (int plane = 0; plane < f->nb_planes; plane++) {
+        int rows = flip_test_rows(f, plane, h);
+        int bytes = flip_test_row_bytes(f, plane, w);
+        for (int y = 0; y < rows; y++) {
+            const uint8_t* row = data[plane] + y * linesize[plane];
+            for (int x = 0; x < bytes; x++) {
+                if (row[x] != flip_test_pattern(plane, rows - 1 - y, x)) return plane;
+            }
+        }
+    }
+    return -1;
+}
+
+void flip_test_clear(const FlipTestFormat* f, int h, AVFrame* frame) {
+    for (int plane = 0; plane < f->nb_planes; plane++) {
+        memset(frame->data[plane], 0, (size_t)flip_test_rows(f, plane, h) * frame->linesize[plane]);
+    }
+}
+
+// Checks one format and size, returning the number of mismatches
+int flip_test_one(const FlipTestFormat* f, int w, int h) {
+    const char* name = av_get_pix_fmt_name(f->format);
+    AVFrame* src = av_frame_alloc();
+    AVFrame* dst = av_frame_alloc();
+    AVFrame* view = av_frame_alloc();
+    int failures = 1;
+    if (!src || !dst || !view) goto end;
+    src->format = dst->format = f->format;
+    src->width = dst->width = w;
+    src->height = dst->height = h;
+    if (av_frame_get_buffer(src, 0) < 0 || av_frame_get_buffer(dst, 0) < 0) {
+        log_warn("%s %dx%d: could not allocate frames", name, w, h);
+        goto end;
+    }
+    if (update_flip_plan(f->format, w, h) < 0) {
+        log_warn("%s %dx%d: no flip plan", name, w, h);
+        goto end;
+    }
+
+    for (int plane = 0; plane < f->nb_planes; plane++) {
+        for (int y = 0; y < flip_test_rows(f, plane, h); y++) {
+            uint8_t* row = src->data[plane] + y * src->linesize[plane];
+            for (int x = 0; x < flip_test_row_bytes(f, plane, w); x++) row[x] = flip_test_pattern(plane, y, x);
+        }
+    }
+    failures = 0;
+
+    flip_view(&flip_plan, src, view);
+    int plane = flip_test_compare(f, w, h, view->data, view->linesize);
+    if (plane >= 0) {
+        log_warn("%s %dx%d: flip_view differs in plane %d", name, w, h, plane);
+        failures++;
+    }
+
+    // In stripes, the way the stripe loop calls it, and then whole with streaming stores
+    flip_test_clear(f, h, dst);
+    for (int y0 = 0; y0 < h; y0 += FLIP_TEST_STRIPE) {
+        flip_copy(&flip_plan, dst->data, dst->linesize, src, y0, FFMIN(FLIP_TEST_STRIPE, h - y0), false);
+    }
+    plane = flip_test_compare(f, w, h, dst->data, dst->linesize);
+    if (plane >= 0) {
+        log_warn("%s %dx%d: striped flip_copy differs in plane %d", name, w, h, plane);
+        failures++;
+    }
+    flip_test_clear(f, h, dst);
+    flip_copy(&flip_plan, dst->data, dst->linesize, src, 0, h, true);
+    stream_fence();
+    plane = flip_test_compare(f, w, h, dst->data, dst->linesize);
+    if (plane >= 0) {
+        log_warn("%s %dx%d: streaming flip_copy differs in plane %d", name, w, h, plane);
+        failures++;
+    }
+    if (!failures) log_info("%s %dx%d: ok", name, w, h);
+
+end:
+    av_frame_free(&src);
+    av_frame_free(&dst);
+    av_frame_free(&view);
+    return failures;
+}
+
+int flip_test(void) {
+    const int sizes[][2] = {{64, 48}, {37, 21}, {1920, 1080}};
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(flip_test_formats) / sizeof(*flip_test_formats); i++) {
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(*sizes); j++) {
+            failures += flip_test_one(&flip_test_formats[i], sizes[j][0], sizes[j][1]);
+        }
+    }
+    if (failures) {
+        log_fatal("Flip test failed with %d mismatches", failures);
+        return 1;
+    }
+    log_info("Flip test passed");
+    return 0;
+}
+#endif
+
+// Orientations are applied while packing to YUYV, so none of them costs a pass of its own. Vertical flips are
+// negative strides on the source, horizontal flips read rows right to left, and the 90 degree rotations transpose
+// bands of TRANSPOSE_BAND source columns into a cache-resident tile that is packed straight into output rows.
+typedef enum {
+    ORIENTATION_NONE,
+    ORIENTATION_VFLIP,
+    ORIENTATION_HFLIP,
+    ORIENTATION_ROTATE180,
+    ORIENTATION_ROTATE90,
+    ORIENTATION_ROTATE270,
+    ORIENTATION_TRANSPOSE,
+    ORIENTATION_COUNT
+} Orientation;
+const char* orientation_names[ORIENTATION_COUNT] = {"none",     "vflip",     "hflip",    "rotate180",
+                                                    "rotate90", "rotate270", "transpose"};
+Orientation orientation = ORIENTATION_VFLIP;
+
+#define TRANSPOSE_BAND 32
+
+bool orientation_transposes(Orientation o) {
+    return o == ORIENTATION_ROTATE90 || o == ORIENTATION_ROTATE270 || o == ORIENTATION_TRANSPOSE;
+}
+
+// Planar 4:2:x YUV source for the oriented pack; chroma_shift is the vertical chroma subsampling
+typedef struct {
+    const uint8_t* data[3];
+    ptrdiff_t linesize[3];
+    int width;
+    int height;
+    int chroma_shift;
+    bool full_range;
+} PlanarView;
+
+uint8_t* transpose_tile = NULL;
+int transpose_tile_size = 0;
+
+int pack_oriented(const PlanarView* source, AVFrame* out, Orientation o, bool stream) {
+    PlanarView v = *source;
+    if (v.full_range && !range_tables_ready) init_range_tables();
+    if (o == ORIENTATION_VFLIP || o == ORIENTATION_ROTATE180 || o == ORIENTATION_ROTATE90) {
+        for (int plane = 0; plane < 3; plane++) {
+            int plane_height = plane ? AV_CEIL_RSHIFT(v.height, v.chroma_shift) : v.height;
+            v.data[plane] += (plane_height - 1) * v.linesize[plane];
+            v.linesize[plane] = -v.linesize[plane];
+        }
+    }
+
+    if (!orientation_transposes(o)) {
+        bool mirror = o == ORIENTATION_HFLIP || o == ORIENTATION_ROTATE180;
+        for (int y = 0; y < v.height; y++) {
+            int cy = y >> v.chroma_shift;
+            (mirror ? pack_yuyv_row_mirror : pack_yuyv_row)(out->data[0] + y * out->linesize[0],
+                                                             v.data[0] + y * v.linesize[0],
+                                                             v.data[1] + cy * v.linesize[1],
+                                                             v.data[2] + cy * v.linesize[2], v.width, v.full_range,
+                                                             stream);
+        }
+        return 0;
+    }
+
+    // Source rows become output columns. Output rows are YUYV, so 4:2:2 chroma only needs every other source row.
+    int out_width = v.height & ~1;
+    int chroma_width = out_width / 2;
+    ptrdiff_t chroma_step = v.chroma_shift ? 1 : 2;
+    int size = TRANSPOSE_BAND * out_width + TRANSPOSE_BAND * chroma_width;
+    if (size > transpose_tile_size) {
+        pipeline_free(transpose_tile);
+        transpose_tile = pipeline_alloc(size);
+        transpose_tile_size = transpose_tile ? size : 0;
+        if (!transpose_tile) return AVERROR(ENOMEM);
+    }
+    uint8_t* luma = transpose_tile;
+    uint8_t* cb = luma + TRANSPOSE_BAND * out_width;
+    uint8_t* cr = cb + TRANSPOSE_BAND / 2 * chroma_width;
+
+    for (int x0 = 0; x0 < v.width; x0 += TRANSPOSE_BAND) {
+        int columns = FFMIN(TRANSPOSE_BAND, v.width - x0);
+        int chroma_columns = (columns + 1) / 2;
+        transpose_plane(luma, out_width, v.data[0] + x0, v.linesize[0], columns, out_width);
+        transpose_plane(cb, chroma_width, v.data[1] + x0 / 2, v.linesize[1] * chroma_step, chroma_columns,
+                        chroma_width);
+        transpose_plane(cr, chroma_width, v.data[2] + x0 / 2, v.linesize[2] * chroma_step, chroma_columns,
+                        chroma_width);
+
+        for (int i = 0; i < columns; i++) {
+            int row = o == ORIENTATION_ROTATE270 ? v.width - 1 - (x0 + i) : x0 + i;
+            pack_yuyv_row(out->data[0] + row * out->linesize[0], luma + i * out_width, cb + i / 2 * chroma_width,
+                          cr + i / 2 * chroma_width, out_width, v.full_range, stream);
+        }
+    }
+    return 0;
+}
+
+// Single-plane counterpart of pack_oriented, for GREY output
+void orient_plane(uint8_t* dst,
+                  int dst_linesize,
+                  const uint8_t* src,
+                  ptrdiff_t src_linesize,
+                  int w,
+                  int h,
+                  Orientation o,
+                  bool full_range) {
+    if (full_range && !range_tables_ready) init_range_tables();
+    if (o == ORIENTATION_VFLIP || o == ORIENTATION_ROTATE180 || o == ORIENTATION_ROTATE90) {
+        src += (h - 1) * src_linesize;
+        src_linesize = -src_linesize;
+    }
+
+    if (!orientation_transposes(o)) {
+        bool mirror = o == ORIENTATION_HFLIP || o == ORIENTATION_ROTATE180;
+        for (int y = 0; y < h; y++) {
+            copy_luma_row(dst + y * dst_linesize, src + y * src_linesize, w, mirror, full_range);
+        }
+        return;
+    }
+
+    // Source columns become output rows, bottom up for rotate270
+    int out_width = h & ~1;
+    if (o == ORIENTATION_ROTATE270) {
+        dst += (w - 1) * dst_linesize;
+        dst_linesize = -dst_linesize;
+    }
+    transpose_plane(dst, dst_linesize, src, src_linesize, w, out_width);
+    if (full_range) {
+        for (int row = 0; row < w; row++) {
+            copy_luma_row(dst + row * dst_linesize, dst + row * dst_linesize, out_width, false, true);
+        }
+    }
+}
+
+// Frames bigger than this core's share of the cache hierarchy are written with streaming stores
+size_t streaming_threshold(void) {
+    static size_t threshold = 0;
+    if (threshold) return threshold;
+
+    long l2 = 0, l3 = 0;
+#if defined(_SC_LEVEL2_CACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long share = l3 > 0 && cpus > 0 ? l3 / cpus : 0;
+    threshold = l2 > share ? l2 : share;
+    if (threshold == 0) threshold = 1 << 20;
+    log_debug("Streaming stores used for output frames over %zu KiB", threshold >> 10);
+    return threshold;
+}
+
+AVCodecContext* decoder_ctx = NULL;  // whichever of preview_decoders decoded last
+AVFrame* input_frame = NULL;
+AVFrame* flipped_frame = NULL;
+AVFrame* output_frame = NULL;
+AVPacket* packet_obj = NULL;
+uint8_t* ffmpeg_output_buffer = NULL;
+int ffmpeg_output_buffer_size = 0;
+int output_frame_size = 0;
+bool output_frame_ready = false;  // the output buffer holds a whole converted frame that can be sent again
+bool output_streaming = false;
+AVFrame* planar_frame = NULL;
+uint8_t* planar_buffer = NULL;
+int planar_buffer_size = 0;
+uint8_t* neutral_chroma = NULL;
+int neutral_chroma_size = 0;
+AVBufferPool* packet_pool = NULL;
+unsigned long packet_pool_size = 0;
+AVBufferRef* packet_buf = NULL;  // the copy last sent, reused once the decoder has let go of it
+
+// Some cameras switch preview format mid-session, e.g. when entering movie mode, so each format found by its magic
+// bytes gets its own decoder, opened on first sight and kept. Buffers no signature matches are probed with libavformat
+// once per distinct leading bytes, remembering the most recent PREVIEW_FORMATS. A failed probe may just be a corrupt
+// buffer, so it is only remembered for PROBE_RETRY_PREVIEWS previews.
+typedef struct {
+    enum AVCodecID codec_id;
+    int offset;
+    int size;
+    const char* magic;
+} PreviewSignature;
+
+const PreviewSignature preview_signatures[] = {
+    {AV_CODEC_ID_MJPEG, 0, 3, "\xff\xd8\xff"},
+    {AV_CODEC_ID_PNG, 0, 8, "\x89PNG\r\n\x1a\n"},
+    {AV_CODEC_ID_WEBP, 8, 4, "WEBP"},
+    {AV_CODEC_ID_TIFF, 0, 4, "II*\0"},
+    {AV_CODEC_ID_TIFF, 0, 4, "MM\0*"},
+    {AV_CODEC_ID_JPEG2000, 0, 4, "\xff\x4f\xff\x51"},
+    {AV_CODEC_ID_JPEG2000, 0, 8, "\0\0\0\x0cjP  "},
+    {AV_CODEC_ID_BMP, 0, 2, "BM"},
+};
+
+#define PREVIEW_FORMATS 8
+#define PREVIEW_HEAD 16
+#define PROBE_RETRY_PREVIEWS 30
+struct {
+    enum AVCodecID codec_id;
+    AVCodecContext* ctx;
+} preview_decoders[PREVIEW_FORMATS];
+struct {
+    uint8_t head[PREVIEW_HEAD];
+    enum AVCodecID codec_id;  // AV_CODEC_ID_NONE when probing failed, so it isn't tried every frame
+    unsigned long expires;    // for a failure, the preview from which it is probed again
+} probed_previews[PREVIEW_FORMATS];
+int probed_preview_count = 0;
+int probed_preview_next = 0;  // entry the next probe replaces once all are used, the oldest
+unsigned long previews_sniffed = 0;
+
+void cleanup_preview_decoders(void) {
+    for (int i = 0; i < PREVIEW_FORMATS; i++) {
+        if (preview_decoders[i].ctx) avcodec_free_context(&preview_decoders[i].ctx);
+    }
+    decoder_ctx = NULL;
+    probed_preview_count = 0;
+    probed_preview_next = 0;
+}
+
+// Decoder configurations the autotuner chooses between. downscale is a log2 DCT scale-down, which libavcodec calls
+// lowres. Frame threading isn't a candidate, since it holds every frame back by the depth of its pipeline.
+typedef enum { BACKEND_FFMPEG, BACKEND_LIBJPEG } DecoderBackend;
+typedef struct {
+    const char* name;
+    DecoderBackend backend;
+    int thread_type;
+    int threads;  // 0 picks one per core
+    int downscale;
+} DecoderConfig;
+
+const DecoderConfig decoder_configs[] = {
+    {"ffmpeg-slice-auto", BACKEND_FFMPEG, FF_THREAD_SLICE, 0, 0},
+    {"ffmpeg", BACKEND_FFMPEG, 0, 1, 0},
+    {"ffmpeg-slice-2", BACKEND_FFMPEG, FF_THREAD_SLICE, 2, 0},
+    {"ffmpeg-slice-4", BACKEND_FFMPEG, FF_THREAD_SLICE, 4, 0},
+    {"ffmpeg-half", BACKEND_FFMPEG, FF_THREAD_SLICE, 0, 1},
+    {"ffmpeg-quarter", BACKEND_FFMPEG, FF_THREAD_SLICE, 0, 2},
+#if defined(USE_LIBJPEG)
+    {"libjpeg", BACKEND_LIBJPEG, 0, 1, 0},
+    {"libjpeg-half", BACKEND_LIBJPEG, 0, 1, 1},
+    {"libjpeg-quarter", BACKEND_LIBJPEG, 0, 1, 2},
+#endif
+};
+#define DECODER_CONFIG_COUNT ((int)(sizeof(decoder_configs) / sizeof(decoder_configs[0])))
+const DecoderConfig* decoder_config = &decoder_configs[0];
+double latency_target_ms = 0;  // 0 means one frame interval at --fps
+bool retune = false;
+
+void configure_decoder(AVCodecContext* ctx, const DecoderConfig* config) {
+    ctx->thread_count = config->threads;
+    ctx->thread_type = config->thread_type;
+    ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+    ctx->flags2 |= AV_CODEC_FLAG2_CHUNKS;
+    ctx->lowres = FFMIN(config->downscale, ctx->codec ? ctx->codec->max_lowres : config->downscale);
+}
+
+// Lays out frame over *buffer, growing it only when the new geometry needs more room. The frame doesn't own the
+// buffer, so av_frame_free leaves it alone.
+int attach_frame_buffer(AVFrame* frame, uint8_t** buffer, int* buffer_size, int format, int w, int h) {
+    int size = av_image_get_buffer_size(format, w, h, 64);
+    if (size < 0) return size;
+    if (size > *buffer_size) {
+        pipeline_free(*buffer);
+        *buffer = pipeline_alloc(size);
+        *buffer_size = *buffer ? size : 0;
+        if (!*buffer) return AVERROR(ENOMEM);
+    }
+
+    frame->format = format;
+    frame->width = w;
+    frame->height = h;
+    return av_image_fill_arrays(frame->data, frame->linesize, *buffer, format, w, h, 64);
+}
+
+// swscale only treats yuvj formats as full range, so full-range frames in other formats have to be flagged. Output is
+// always limited range. Only touches the context when its ranges are off, since setting them rebuilds its tables.
+void set_sws_range(struct SwsContext* ctx, bool full_range) {
+    int *inv_table, *table;
+    int src_range, dst_range, brightness, contrast, saturation;
+    if (sws_getColorspaceDetails(ctx, &inv_table, &src_range, &table, &dst_range, &brightness, &contrast, &saturation)
+        < 0) {
+        return;
+    }
+    if (src_range == full_range && dst_range == 0) return;
+    sws_setColorspaceDetails(ctx, inv_table, full_range, table, 0, brightness, contrast, saturation);
+}
+
+// Converters for the last few geometries and formats. Cameras that change liveview size on zoom or in movie mode go
+// back and forth between a couple, and building a context (and its range tables) costs more than converting a frame.
+#define SWS_CACHE_SIZE 4
+typedef struct {
+    struct SwsContext* ctx;
+    int src_width;
+    int src_height;
+    int src_format;
+    int dst_width;
+    int dst_height;
+    int dst_format;
+    int flags;
+    bool full_range;
+    unsigned long last_used;
+} SwsCacheEntry;
+
+SwsCacheEntry sws_cache[SWS_CACHE_SIZE];
+unsigned long sws_cache_clock = 0;
+
+// Returns the cached converter for these parameters, building one in place of the least recently used if needed
+struct SwsContext* get_sws_context(int src_width,
+                                   int src_height,
+                                   int src_format,
+                                   int dst_width,
+                                   int dst_height,
+                                   int dst_format,
+                                   int flags,
+                                   bool full_range) {
+    SwsCacheEntry key = {
+        .src_width = src_width,
+        .src_height = src_height,
+        .src_format = src_format,
+        .dst_width = dst_width,
+        .dst_height = dst_height,
+        .dst_format = dst_format,
+        .flags = flags,
+        .full_range = full_range,
+    };
+    SwsCacheEntry* victim = &sws_cache[0];
+    for (int i = 0; i < SWS_CACHE_SIZE; i++) {
+        SwsCacheEntry* entry = &sws_cache[i];
+        if (entry->ctx && entry->src_width == src_width && entry->src_height == src_height
+            && entry->src_format == src_format && entry->dst_width == dst_width && entry->dst_height == dst_height
+            && entry->dst_format == dst_format && entry->flags == flags && entry->full_range == full_range) {
+            entry->last_used = ++sws_cache_clock;
+            return entry->ctx;
+        }
+        if (victim->ctx && (!entry->ctx || entry->last_used < victim->last_used)) victim = entry;
+    }
+
+    if (victim->ctx) sws_freeContext(victim->ctx);
+    key.ctx = sws_getContext(src_width, src_height, src_format, dst_width, dst_height, dst_format, flags, NULL, NULL,
+                             NULL);
+    if (key.ctx) {
+        set_sws_range(key.ctx, full_range);
+        log_debug("Built a converter for %dx%d %s to %dx%d %s", src_width, src_height,
+                  av_get_pix_fmt_name(src_format), dst_width, dst_height, av_get_pix_fmt_name(dst_format));
+    }
+    key.last_used = ++sws_cache_clock;
+    *victim = key;
+    return key.ctx;
+}
+
+void cleanup_sws_cache(void) {
+    for (int i = 0; i < SWS_CACHE_SIZE; i++) {
+        if (sws_cache[i].ctx) sws_freeContext(sws_cache[i].ctx);
+        sws_cache[i].ctx = NULL;
+    }
+}
+
+// Rows per conversion stripe, sized so that a stripe's source and output rows take up about half of L2
+int stripe_rows(const AVFrame* frame, int output_linesize) {
+    static long l2 = 0;
+    if (!l2) {
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+        l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        if (l2 <= 0) l2 = 256 << 10;
+    }
+
+    long row_bytes = output_linesize;
+    for (int plane = 0; plane < 4 && frame->data[plane]; plane++) row_bytes += abs(frame->linesize[plane]);
+    // Multiples of 16 rows keep every slice aligned to chroma subsampling and JPEG MCU rows
+    int rows = (l2 / 2 / row_bytes) & ~15;
+    return rows < 16 ? 16 : rows;
+}
+
+// Framing: --crop picks a region of the preview and --zoom magnifies around its centre. SIGUSR1 and SIGUSR2 step the
+// zoom in and out while running. Only the region is decoded (with libjpeg-turbo) and flipped and packed, so a 2x zoom
+// costs about a quarter of the work.
+#define ZOOM_STEP 25
+#define ZOOM_MAX 800
+#define REGION_MIN 16
+
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+} Rect;
+Rect crop = {0};  // w == 0 means the whole frame
+volatile sig_atomic_t zoom_percent = 100;
+// Output geometry while framing; a zoom changed at runtime rescales into it rather than resizing the webcam
+int framed_width = 0;
+int framed_height = 0;
+bool framed = false;  // crop or zoom has been used, so the geometry stays even when zoomed back out
+AVFrame* region_frame = NULL;
+uint8_t* region_buffer = NULL;
+int region_buffer_size = 0;
+
+bool framing_active(void) {
+    return crop.w || zoom_percent != 100;
+}
+
+// The part of a w x h frame to decode, on even coordinates so it never splits a chroma sample. The frame may be
+// decoded scaled down by scale, while --crop is given in source pixels.
+Rect region_of_interest(int w, int h, int scale) {
+    // A frame smaller than REGION_MIN is used whole
+    int min_w = FFMIN(REGION_MIN, w);
+    int min_h = FFMIN(REGION_MIN, h);
+    Rect r = crop.w ? (Rect){crop.x / scale, crop.y / scale, crop.w / scale, crop.h / scale} : (Rect){0, 0, w, h};
+    r.x = FFMIN(r.x, w - min_w);
+    r.y = FFMIN(r.y, h - min_h);
+    r.w = FFMAX(FFMIN(r.w, w - r.x), min_w);
+    r.h = FFMAX(FFMIN(r.h, h - r.y), min_h);
+
+    int zoom = zoom_percent;
+    int zoomed_w = FFMAX(r.w * 100 / zoom, min_w);
+    int zoomed_h = FFMAX(r.h * 100 / zoom, min_h);
+    r.x = (r.x + (r.w - zoomed_w) / 2) & ~1;
+    r.y = (r.y + (r.h - zoomed_h) / 2) & ~1;
+    r.w = zoomed_w & ~1;
+    r.h = zoomed_h & ~1;
+    return r;
+}
+
+#if defined(USE_LIBJPEG)
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf escape;
+} JpegError;
+
+struct jpeg_decompress_struct jpeg_decoder;
+JpegError jpeg_error;
+bool jpeg_decoder_ready = false;
+uint8_t* scanline_buffer = NULL;
+int scanline_buffer_size = 0;
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+    longjmp(((JpegError*)cinfo->err)->escape, 1);
+}
+
+void jpeg_output_message(j_common_ptr cinfo) {
+    char message[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, message);
+    log_debug("libjpeg: %s", message);
+}
+
+// Decodes only the region of interest of a JPEG into frame as full-range 4:2:2, or just its luma with --gray.
+// jpeg_crop_scanline narrows decoding to the iMCU columns that overlap the region and jpeg_skip_scanlines passes over
+// the rows above it. Returns 1 when libjpeg can't produce those formats, so the caller can fall back to libavcodec.
+int decode_jpeg_region(const char* data, unsigned long size, AVFrame* frame) {
+    if (size < 2 || (uint8_t)data[0] != 0xFF || (uint8_t)data[1] != 0xD8) return 1;
+
+    if (!jpeg_decoder_ready) {
+        jpeg_decoder.err = jpeg_std_error(&jpeg_error.pub);
+        jpeg_error.pub.error_exit = jpeg_error_exit;
+        jpeg_error.pub.output_message = jpeg_output_message;
+        jpeg_create_decompress(&jpeg_decoder);
+        jpeg_decoder_ready = true;
+    }
+
+    if (setjmp(jpeg_error.escape)) {
+        jpeg_abort_decompress(&jpeg_decoder);
+        return 1;
+    }
+
+    jpeg_mem_src(&jpeg_decoder, (const unsigned char*)data, size);
+    jpeg_read_header(&jpeg_decoder, TRUE);
+    bool gray = gray_mode != GRAY_OFF;
+    bool supported = jpeg_decoder.num_components == 3 && jpeg_decoder.jpeg_color_space == JCS_YCbCr;
+    if (!supported && !(gray && jpeg_decoder.jpeg_color_space == JCS_GRAYSCALE)) {
+        jpeg_abort_decompress(&jpeg_decoder);
+        return 1;
+    }
+    // Asking for grayscale makes libjpeg skip the IDCT and upsampling of both chroma components
+    jpeg_decoder.out_color_space = gray ? JCS_GRAYSCALE : JCS_YCbCr;
+    jpeg_decoder.dct_method = JDCT_IFAST;
+    jpeg_decoder.do_fancy_upsampling = FALSE;
+    if (decoder_config->backend == BACKEND_LIBJPEG) jpeg_decoder.scale_denom = 1 << decoder_config->downscale;
+    jpeg_calc_output_dimensions(&jpeg_decoder);
+
+    Rect roi = region_of_interest(jpeg_decoder.output_width, jpeg_decoder.output_height, jpeg_decoder.scale_denom);
+    int ret = attach_frame_buffer(frame, &region_buffer, &region_buffer_size,
+                                  gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUVJ422P, roi.w, roi.h);
+    if (ret < 0) {
+        jpeg_abort_decompress(&jpeg_decoder);
+        log_warn("Failed to allocate region frame: %s", av_err2str(ret));
+        return -1;
+    }
+    frame->color_range = AVCOL_RANGE_JPEG;
+
+    jpeg_start_decompress(&jpeg_decoder);
+    JDIMENSION column = roi.x, columns = roi.w;
+    jpeg_crop_scanline(&jpeg_decoder, &column, &columns);
+    int pixel_size = jpeg_decoder.output_components;
+    if ((int)columns * pixel_size > scanline_buffer_size) {
+        pipeline_free(scanline_buffer);
+        scanline_buffer = pipeline_alloc(columns * pixel_size);
+        scanline_buffer_size = scanline_buffer ? columns * pixel_size : 0;
+        if (!scanline_buffer) {
+            jpeg_abort_decompress(&jpeg_decoder);
+            log_warn("Failed to allocate scanline buffer");
+            return -1;
+        }
+    }
+    if (roi.y) jpeg_skip_scanlines(&jpeg_decoder, roi.y);
+
+    // Without fancy upsampling every chroma sample is repeated across its pair, so even pixels carry the originals
+    JSAMPROW scanline = scanline_buffer;
+    const uint8_t* px = scanline_buffer + (roi.x - column) * pixel_size;
+    for (int row = 0; row < roi.h; row++) {
+        jpeg_read_scanlines(&jpeg_decoder, &scanline, 1);
+        uint8_t* y = frame->data[0] + row * frame->linesize[0];
+        if (gray) {
+            memcpy(y, px, roi.w);
+            continue;
+        }
+        uint8_t* u = frame->data[1] + row * frame->linesize[1];
+        uint8_t* v = frame->data[2] + row * frame->linesize[2];
+        for (int x = 0; x < roi.w; x += 2) {
+            y[x] = px[x * 3];
+            y[x + 1] = px[x * 3 + 3];
+            u[x / 2] = px[x * 3 + 1];
+            v[x / 2] = px[x * 3 + 2];
+        }
+    }
+
+    // Leaves the rows below the region undecoded
+    jpeg_abort_decompress(&jpeg_decoder);
+    return 0;
+}
+
+void cleanup_jpeg_decoder(void) {
+    if (jpeg_decoder_ready) jpeg_destroy_decompress(&jpeg_decoder);
+    jpeg_decoder_ready = false;
+    pipeline_free(scanline_buffer);
+    scanline_buffer = NULL;
+    scanline_buffer_size = 0;
+}
+#endif
+
+int convert_ffmpeg(const char* image_data, unsigned long image_data_size, uint8_t** output_data, int* output_data_size);
+
+typedef enum { SOURCE_CAMERA, SOURCE_SYNTHETIC, SOURCE_TRACE } SourceType;
+SourceType source_type = SOURCE_CAMERA;
+
+// Camera previews download straight into slots of a pool, through a CameraFile backed by our own handler, rather than
+// into a CameraFile's buffer that the next capture overwrites. A slot is only reused once nothing holds a reference to
+// it, so anything that needs a preview past the next capture takes a reference instead of a copy. Slots are padded
+// for libavcodec and only ever grow. Each slot's data is also an AVBuffer the slot keeps one reference to, so the
+// decoder can be handed the preview itself; while it holds a reference of its own the slot isn't reused either.
+#define PREVIEW_SLOTS 8      // the decoder tuner's samples plus a few in flight
+#define PREVIEW_WAIT_MS 500  // how long a capture waits for a free slot before saying so
+typedef struct {
+    uint8_t* data;
+    AVBufferRef* buf;  // the slot's own reference to data
+    unsigned long size;
+    unsigned long capacity;  // not counting the padding
+    unsigned long read;      // how far a reader of the CameraFile has got
+    atomic_int refs;
+} PreviewSlot;
+
+PreviewSlot preview_slots[PREVIEW_SLOTS];
+PreviewSlot* filling_preview = NULL;   // the slot the camera is downloading into
+PreviewSlot* captured_preview = NULL;  // the latest preview, held by the camera source until the next capture
+PreviewSlot* current_preview = NULL;   // the pooled preview the main loop is converting, if it is pooled
+
+PreviewSlot* preview_acquire(void) {
+    for (int i = 0; i < PREVIEW_SLOTS; i++) {
+        int unused = 0;
+        if (atomic_compare_exchange_strong(&preview_slots[i].refs, &unused, 1)) {
+            // A packet the decoder hasn't let go of yet still points into it
+            if (preview_slots[i].buf && av_buffer_get_ref_count(preview_slots[i].buf) > 1) {
+                atomic_store(&preview_slots[i].refs, 0);
+                continue;
+            }
+            preview_slots[i].size = 0;
+            preview_slots[i].read = 0;
+            return &preview_slots[i];
+        }
+    }
+    return NULL;
+}
+
+extern volatile bool alive;
+atomic_bool preview_wait_stop = false;
+
+// Waits for a slot to come free rather than failing the capture, since every one being held is only ever a matter of
+// the consumers falling behind. Returns NULL once the stream is stopping.
+PreviewSlot* preview_acquire_wait(void) {
+    struct timespec wait = {.tv_nsec = 1000000};
+    for (int waited = 0; alive && !atomic_load(&preview_wait_stop); waited++) {
+        PreviewSlot* slot = preview_acquire();
+        if (slot) return slot;
+        if (waited == PREVIEW_WAIT_MS) log_warn("Every preview buffer is still in use, waiting for one to free");
+        nanosleep(&wait, NULL);
+    }
+    return NULL;
+}
+
+void preview_ref(PreviewSlot* slot) {
+    atomic_fetch_add(&slot->refs, 1);
+}
+
+void preview_unref(PreviewSlot* slot) {
+    atomic_fetch_sub(&slot->refs, 1);
+}
+
+// The slot the CameraFile stands for: the one being downloaded into, or between captures the latest preview
+PreviewSlot* preview_file_slot(void) {
+    return filling_preview ? filling_preview : captured_preview;
+}
+
+int preview_file_size(void* priv, uint64_t* size) {
+    (void)priv;
+    PreviewSlot* slot = preview_file_slot();
+    *size = slot ? slot->size : 0;
+    return GP_OK;
+}
+
+// Reads the preview back out in order, for camlibs and gp_file_* calls that read the CameraFile. Once it has all been
+// read, the next read starts from the beginning again.
+int preview_file_read(void* priv, unsigned char* data, uint64_t* len) {
+    (void)priv;
+    PreviewSlot* slot = preview_file_slot();
+    if (!slot) return GP_ERROR;
+    if (slot->read >= slot->size) slot->read = 0;
+    uint64_t n = FFMIN(*len, slot->size - slot->read);
+    if (n) memcpy(data, slot->data + slot->read, n);
+    slot->read += n;
+    *len = n;
+    return GP_OK;
+}
+
+// Adds bytes to the end of the preview in slot, keeping it padded
+int preview_append(PreviewSlot* slot, const uint8_t* data, unsigned long size) {
+    if (slot->size + size > slot->capacity) {
+        // Leave headroom so a slowly growing preview doesn't reallocate every frame
+        unsigned long capacity = (slot->size + size) * 5 / 4;
+        size_t padded = capacity + AV_INPUT_BUFFER_PADDING_SIZE;
+        uint8_t* grown = pipeline_alloc(padded);
+        if (!grown) return -1;
+        AVBufferRef* buf = av_buffer_create(grown, padded, pipeline_buffer_free, NULL, 0);
+        if (!buf) {
+            pipeline_free(grown);
+            return -1;
+        }
+        if (slot->size) memcpy(grown, slot->data, slot->size);
+        // Frees the old data, unless a packet still holds it
+        av_buffer_unref(&slot->buf);
+        slot->buf = buf;
+        slot->data = grown;
+        slot->capacity = capacity;
+    }
+    memcpy(slot->data + slot->size, data, size);
+    slot->size += size;
+    memset(slot->data + slot->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
+// Called by libgphoto2 with each piece of the preview as it comes off the camera
+int preview_file_write(void* priv, unsigned char* data, uint64_t* len) {
+    (void)priv;
+    if (!filling_preview) return GP_ERROR;
+    return preview_append(filling_preview, data, *len) < 0 ? GP_ERROR_NO_MEMORY : GP_OK;
+}
+
+CameraFileHandler preview_file_handler = {
+    .size = preview_file_size,
+    .read = preview_file_read,
+    .write = preview_file_write,
+};
+
+void cleanup_preview_pool(void) {
+    captured_preview = NULL;
+    current_preview = NULL;
+    for (int i = 0; i < PREVIEW_SLOTS; i++) {
+        av_buffer_unref(&preview_slots[i].buf);
+        preview_slots[i] = (PreviewSlot){0};
+    }
+}
+
+Camera* gp2_camera = NULL;
+CameraFile* gp2_file = NULL;
+CameraList* gp2_camlist = NULL;
+GPContext* gp2_context = NULL;
+
+int init_camera(void) {
+    int ret;
+
+    // Initialize gPhoto2 context
+    gp2_context = gp_context_new();
+
+    // Create camera object
+    ret = gp_camera_new(&gp2_camera);
+    if (ret < GP_OK) {
+        log_fatal("Failed to instantiate a new camera: %s", gp_result_as_string(ret));
+        return -1;
+    }
+
+    gp_list_new(&gp2_camlist);
+    ret = gp_camera_autodetect(gp2_camlist, gp2_context);
+    if (ret < GP_OK) {
+        log_fatal("Failed to autodetect cameras: %s", gp_result_as_string(ret));
+        return -1;
+    }
+
+    if (gp_list_count(gp2_camlist) < 1) {
+        log_fatal("No cameras detected!");
+        return -1;
+    }
+
+    // If user specified a camera, check if it exists
+    if (*camera_model) {
+        int index = -1;
+        ret = gp_list_find_by_name(gp2_camlist, &index, camera_model);
+        if (ret < GP_OK) {
+            log_warn("Camera '%s' not found, using first detected camera", camera_model);
+            const char* first_camera = NULL;
+            gp_list_get_name(gp2_camlist, 0, &first_camera);
+            snprintf(camera_model, sizeof(camera_model), "%s", first_camera);
+        } else {
+            log_debug("Found requested camera: %s", camera_model);
+            int gp2_camera_index = ret;
+
+            static CameraAbilitiesList* gp2_abilities_list = NULL;
+            ret = gp_abilities_list_new(&gp2_abilities_list);
+            if (ret < GP_OK) {
+                log_fatal("Failed to initialize abilities list: %s", gp_result_as_string(ret));
+                return -1;
+            }
+            ret = gp_abilities_list_load(gp2_abilities_list, gp2_context);
+            if (ret < GP_OK) {
+                log_fatal("Failed to populate abilities list: %s", gp_result_as_string(ret));
+                return -1;
+            }
+
+            CameraAbilities gp2_abilities;
+            ret = gp_abilities_list_lookup_model(gp2_abilities_list, camera_model);
+            if (ret < GP_OK) {
+                log_fatal("Lookup failed for specified model: %s", gp_result_as_string(ret));
+                return -1;
+            }
+            ret = gp_abilities_list_get_abilities(gp2_abilities_list, ret, &gp2_abilities);
+            if (ret < GP_OK) {
+                log_fatal("Failed to get abilities for specified model: %s", gp_result_as_string(ret));
+                return -1;
+            }
+            ret = gp_camera_set_abilities(gp2_camera, gp2_abilities);
+            if (ret < GP_OK) {
+                log_fatal("Failed to set abilities for specified model: %s", gp_result_as_string(ret));
+                return -1;
+            }
+
+            static GPPortInfoList* gp2_port_info_list = NULL;
+            ret = gp_port_info_list_new(&gp2_port_info_list);
+            if (ret < GP_OK) {
+                log_fatal("Failed to initialize port info list: %s", gp_result_as_string(ret));
+                return -1;
+            }
+            ret = gp_port_info_list_load(gp2_port_info_list);
+            if (ret < GP_OK) {
+                log_fatal("Failed to load port info list: %s", gp_result_as_string(ret));
+                return -1;
+            }
+            ret = gp_port_info_list_count(gp2_port_info_list);
+            if (ret < GP_OK) {
+                log_fatal("Failed to populate count to port info list: %s", gp_result_as_string(ret));
+                return -1;
+            }
+            const char* gp2_port_path;
+            ret = gp_list_get_value(gp2_camlist, gp2_camera_index, &gp2_port_path);
+            if (ret < GP_OK) {
+                log_fatal("Failed to get port path for specified camera: %s", gp_result_as_string(ret));
+                return -1;
+            }
+            ret = gp_port_info_list_lookup_path(gp2_port_info_list, gp2_port_path);
+            if (ret < GP_OK) {
+                log_fatal("Lookup failed for the port of the specified camera within the port info list: %s",
+                          gp_result_as_string(ret));
+                return -1;
+            }
+            int gp2_port_info_index = ret;
+            GPPortInfo gp2_port_info;
+            ret = gp_port_info_list_get_info(gp2_port_info_list, gp2_port_info_index, &gp2_port_info);
+            if (ret < GP_OK) {
+                log_fatal("Failed to get info for port from port info list: %s", gp_result_as_string(ret));
+                return -1;
+            }
+
+            ret = gp_camera_set_port_info(gp2_camera, gp2_port_info);
+            if (ret < GP_OK) {
+                log_fatal("Failed to set the port info of the camera to the specified port info: %s",
+                          gp_result_as_string(ret));
+                return -1;
+            }
+        }
+    } else {
+        // No camera specified, use first detected
+        const char* first_camera = NULL;
+        gp_list_get_name(gp2_camlist, 0, &first_camera);
+        snprintf(camera_model, sizeof(camera_model), "%s", first_camera);
+    }
+
+    log_debug("Using camera: %s", camera_model);
+
+    ret = gp_camera_init(gp2_camera, gp2_context);
+    if (ret < GP_OK) {
+        log_fatal("Failed to autodetect camera: %s", gp_result_as_string(ret));
+        return -1;
+    }
+
+    ret = gp_file_new_from_handler(&gp2_file, &preview_file_handler, NULL);
+    if (ret < GP_OK) {
+        log_fatal("Failed to create CameraFile: %s", gp_result_as_string(ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+int capture_camera(const char** image_data, unsigned long* image_data_size) {
+    // The last preview goes back to the pool, unless something still holds a reference to it
+    if (captured_preview) preview_unref(captured_preview);
+    captured_preview = NULL;
+
+    filling_preview = preview_acquire_wait();
+    if (!filling_preview) return 1;
+    int ret = gp_camera_capture_preview(gp2_camera, gp2_file, gp2_context);
+    PreviewSlot* slot = filling_preview;
+    filling_preview = NULL;
+    if (ret != GP_OK || !slot->data) {
+        preview_unref(slot);
+        log_fatal("Failed to capture preview: %s", gp_result_as_string(ret != GP_OK ? ret : GP_ERROR));
+        return -1;
+    }
+
+    captured_preview = slot;
+    *image_data = (const char*)slot->data;
+    *image_data_size = slot->size;
+    return 0;
+}
+
+void cleanup_camera(void) {
+    log_debug("Cleaning up gphoto2...");
+    if (gp2_camlist) gp_list_free(gp2_camlist);
+    if (gp2_file) gp_file_free(gp2_file);
+    if (gp2_camera) {
+        if (gp2_context) gp_camera_exit(gp2_camera, gp2_context);
+        gp_camera_free(gp2_camera);
+    }
+    if (gp2_context) gp_context_unref(gp2_context);
+}
+
+// The synthetic source encodes a set of JPEG test patterns once at startup and then hands them out at a fixed
+// rate, the same way gp_camera_capture_preview would. Each pattern carries a COM segment whose frame counter is
+// patched in place before the buffer is emitted.
+typedef enum { PATTERN_BARS, PATTERN_GRADIENT, PATTERN_CHECKER, PATTERN_NOISE, PATTERN_COUNT } SyntheticPattern;
+const char* synthetic_pattern_names[PATTERN_COUNT] = {"bars", "gradient", "checker", "noise"};
+
+#define SYNTHETIC_COUNTER_DIGITS 10
+
+struct {
+    int width;
+    int height;
+    double fps;
+    double jitter_ms;
+    double corrupt_percent;
+    unsigned int patterns;  // bitmask of SyntheticPattern
+    uint8_t* frames[PATTERN_COUNT];
+    int frame_sizes[PATTERN_COUNT];
+    int counter_offsets[PATTERN_COUNT];
+    int nb_frames;
+    uint64_t frame_count;
+    uint64_t corrupt_count;
+    uint64_t rng;
+    struct timespec next_emit;
+} synthetic = {.width = 1920, .height = 1080, .fps = 30, .patterns = (1 << PATTERN_COUNT) - 1, .rng = 0x2545F4914F6CDD1DULL};
+
+uint64_t synthetic_random(void) {
+    // xorshift64, seeded with a constant so soak runs are reproducible
+    synthetic.rng ^= synthetic.rng << 13;
+    synthetic.rng ^= synthetic.rng >> 7;
+    synthetic.rng ^= synthetic.rng << 17;
+    return synthetic.rng;
+}
+
+double synthetic_random_unit(void) { return (synthetic_random() >> 11) * (1.0 / 9007199254740992.0); }
+
+void fill_synthetic_pattern(AVFrame* frame, SyntheticPattern pattern) {
+    // 75% colour bars as full-range BT.601 YUV: white, yellow, cyan, green, magenta, red, blue, black
+    static const uint8_t bars[8][3] = {{191, 128, 128}, {170, 32, 139}, {134, 150, 32}, {112, 54, 43},
+                                       {79, 202, 213},  {57, 106, 224}, {21, 224, 117}, {0, 128, 128}};
+    int w = frame->width;
+    int h = frame->height;
+
+    for (int y = 0; y < h; y++) {
+        uint8_t* luma = frame->data[0] + y * frame->linesize[0];
+        uint8_t* cb = frame->data[1] + y * frame->linesize[1];
+        uint8_t* cr = frame->data[2] + y * frame->linesize[2];
+        for (int x = 0; x < w; x++) {
+            uint8_t yuv[3];
+            switch (pattern) {
+                case PATTERN_BARS:
+                    memcpy(yuv, bars[x * 8 / w], 3);
+                    break;
+                case PATTERN_GRADIENT:
+                    yuv[0] = (x * 255 / w + y * 255 / h) / 2;
+                    yuv[1] = x * 255 / w;
+                    yuv[2] = y * 255 / h;
+                    break;
+                case PATTERN_CHECKER:
+                    yuv[0] = ((x / 32) ^ (y / 32)) & 1 ? 235 : 16;
+                    yuv[1] = yuv[2] = 128;
+                    break;
+                default: {
+                    uint64_t r = synthetic_random();
+                    yuv[0] = r;
+                    yuv[1] = r >> 8;
+                    yuv[2] = r >> 16;
+                    break;
+                }
+            }
+            luma[x] = yuv[0];
+            // 4:2:2 chroma takes the left pixel of each pair
+            if (!(x & 1)) {
+                cb[x >> 1] = yuv[1];
+                cr[x >> 1] = yuv[2];
+            }
+        }
+    }
+}
+
+int encode_synthetic_pattern(SyntheticPattern pattern) {
+    int ret = -1;
+    AVCodecContext* encoder_ctx = NULL;
+    AVFrame* frame = NULL;
+    AVPacket* packet = NULL;
+
+    const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!encoder) {
+        log_fatal("No MJPEG encoder available to build synthetic test patterns");
+        return -1;
+    }
+
+    encoder_ctx = avcodec_alloc_context3(encoder);
+    frame = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (!encoder_ctx || !frame || !packet) {
+        log_fatal("Failed to allocate synthetic pattern encoder");
+        goto end;
+    }
+
+    encoder_ctx->width = synthetic.width;
+    encoder_ctx->height = synthetic.height;
+    encoder_ctx->pix_fmt = AV_PIX_FMT_YUVJ422P;
+    encoder_ctx->time_base = (AVRational){1, 30};
+    // Fixed quantizer so the frame sizes resemble a camera preview rather than a rate-controlled stream
+    encoder_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+    encoder_ctx->global_quality = FF_QP2LAMBDA * 3;
+
+    ret = avcodec_open2(encoder_ctx, encoder, NULL);
+    if (ret < 0) {
+        log_fatal("Could not open MJPEG encoder: %s", av_err2str(ret));
+        goto end;
+    }
+
+    frame->format = AV_PIX_FMT_YUVJ422P;
+    frame->width = synthetic.width;
+    frame->height = synthetic.height;
+    ret = av_frame_get_buffer(frame, 0);
+    if (ret < 0) {
+        log_fatal("Failed to allocate synthetic pattern frame: %s", av_err2str(ret));
+        goto end;
+    }
+    fill_synthetic_pattern(frame, pattern);
+    frame->quality = encoder_ctx->global_quality;
+    frame->pts = 0;
+
+    ret = avcodec_send_frame(encoder_ctx, frame);
+    if (ret >= 0) ret = avcodec_receive_packet(encoder_ctx, packet);
+    if (ret < 0) {
+        log_fatal("Failed to encode synthetic pattern `%s`: %s", synthetic_pattern_names[pattern], av_err2str(ret));
+        goto end;
+    }
+    if (packet->size < 4 || packet->data[0] != 0xFF || packet->data[1] != 0xD8) {
+        log_fatal("MJPEG encoder produced an unexpected bitstream for pattern `%s`", synthetic_pattern_names[pattern]);
+        ret = -1;
+        goto end;
+    }
+
+    // Insert a COM segment right after SOI that carries the frame counter
+    char comment[64];
+    int comment_size = snprintf(comment, sizeof(comment), "webcamize-synthetic pattern=%s frame=%0*d",
+                                synthetic_pattern_names[pattern], SYNTHETIC_COUNTER_DIGITS, 0);
+    int segment_size = 4 + comment_size;
+    int index = synthetic.nb_frames;
+    uint8_t* jpeg = malloc(packet->size + segment_size);
+    if (!jpeg) {
+        log_fatal("Failed to allocate synthetic frame buffer");
+        ret = -1;
+        goto end;
+    }
+    jpeg[0] = 0xFF;
+    jpeg[1] = 0xD8;
+    jpeg[2] = 0xFF;
+    jpeg[3] = 0xFE;
+    jpeg[4] = (segment_size - 2) >> 8;
+    jpeg[5] = (segment_size - 2) & 0xFF;
+    memcpy(jpeg + 6, comment, comment_size);
+    memcpy(jpeg + 2 + segment_size, packet->data + 2, packet->size - 2);
+
+    synthetic.frames[index] = jpeg;
+    synthetic.frame_sizes[index] = packet->size + segment_size;
+    synthetic.counter_offsets[index] = 6 + comment_size - SYNTHETIC_COUNTER_DIGITS;
+    synthetic.nb_frames++;
+    log_debug("Encoded synthetic pattern `%s`: %d bytes", synthetic_pattern_names[pattern], synthetic.frame_sizes[index]);
+    ret = 0;
+
+end:
+    if (packet) av_packet_free(&packet);
+    if (frame) av_frame_free(&frame);
+    if (encoder_ctx) avcodec_free_context(&encoder_ctx);
+    return ret;
+}
+
+int init_synthetic(void) {
+    for (int pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+        if (!(synthetic.patterns & (1 << pattern))) continue;
+        if (encode_synthetic_pattern(pattern) < 0) return -1;
+    }
+
+    snprintf(camera_model, sizeof(camera_model), "Synthetic");
+    clock_gettime(CLOCK_MONOTONIC, &synthetic.next_emit);
+    log_info("Synthetic source: %dx%d at %.2f FPS, jitter %.2f ms, %.2f%% corrupt frames", synthetic.width,
+             synthetic.height, synthetic.fps, synthetic.jitter_ms, synthetic.corrupt_percent);
+    return 0;
+}
+
+int capture_synthetic(const char** image_data, unsigned long* image_data_size) {
+    if (synthetic.fps > 0) {
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &synthetic.next_emit, NULL);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long period = 1000000000L / synthetic.fps;
+        long jitter = (synthetic_random_unit() * 2 - 1) * synthetic.jitter_ms * 1000000;
+        long next = synthetic.next_emit.tv_nsec + period + jitter;
+        synthetic.next_emit.tv_sec += next / 1000000000L;
+        synthetic.next_emit.tv_nsec = next % 1000000000L;
+        if (synthetic.next_emit.tv_nsec < 0) {
+            synthetic.next_emit.tv_sec--;
+            synthetic.next_emit.tv_nsec += 1000000000L;
+        }
+
+        // If the consumer fell more than a period behind, restart the schedule instead of bursting to catch up
+        long behind = (now.tv_sec - synthetic.next_emit.tv_sec) * 1000000000L
+                      + (now.tv_nsec - synthetic.next_emit.tv_nsec);
+        if (behind > period) synthetic.next_emit = now;
+    }
+
+    int index = synthetic.frame_count % synthetic.nb_frames;
+    uint8_t* jpeg = synthetic.frames[index];
+    char counter[SYNTHETIC_COUNTER_DIGITS + 1];
+    snprintf(counter, sizeof(counter), "%0*llu", SYNTHETIC_COUNTER_DIGITS,
+             (unsigned long long)(synthetic.frame_count % 10000000000ULL));
+    memcpy(jpeg + synthetic.counter_offsets[index], counter, SYNTHETIC_COUNTER_DIGITS);
+
+    *image_data = (const char*)jpeg;
+    *image_data_size = synthetic.frame_sizes[index];
+
+    // Simulate a truncated USB transfer by cutting the frame somewhere in its entropy-coded data
+    if (synthetic.corrupt_percent > 0 && synthetic_random_unit() * 100 < synthetic.corrupt_percent) {
+        *image_data_size = synthetic.frame_sizes[index] / 4 + synthetic_random() % (synthetic.frame_sizes[index] / 2);
+        synthetic.corrupt_count++;
+        log_debug("Synthetic frame %llu truncated to %lu bytes", (unsigned long long)synthetic.frame_count,
+                  *image_data_size);
+    }
+
+    synthetic.frame_count++;
+    return 0;
+}
+
+void cleanup_synthetic(void) {
+    log_info("Synthetic source emitted %llu frames, %llu corrupted", (unsigned long long)synthetic.frame_count,
+             (unsigned long long)synthetic.corrupt_count);
+    for (int i = 0; i < synthetic.nb_frames; i++) free(synthetic.frames[i]);
+    synthetic.nb_frames = 0;
+}
+
+int parse_synthetic_spec(const char* spec) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "%s", spec);
+
+    // WIDTHxHEIGHT[@FPS][,jitter=MS][,corrupt=PERCENT][,patterns=NAME+NAME...]
+    char* options = strchr(buffer, ',');
+    if (options) *options++ = '\0';
+    if (*buffer) {
+        char* fps = strchr(buffer, '@');
+        if (fps) *fps++ = '\0';
+        if (*buffer && (sscanf(buffer, "%dx%d", &synthetic.width, &synthetic.height) != 2 || synthetic.width < 16
+                        || synthetic.height < 16)) {
+            log_fatal("Invalid synthetic resolution `%s`, expected WIDTHxHEIGHT", buffer);
+            return -1;
+        }
+        if (fps && (synthetic.fps = atof(fps)) < 0) {
+            log_fatal("Invalid synthetic frame rate `%s`", fps);
+            return -1;
+        }
+    }
+    // The MJPEG encoder works on whole 4:2:2 macroblocks
+    synthetic.width &= ~1;
+
+    for (char* option = options ? strtok(options, ",") : NULL; option; option = strtok(NULL, ",")) {
+        if (strncmp(option, "jitter=", 7) == 0) {
+            synthetic.jitter_ms = atof(option + 7);
+        } else if (strncmp(option, "corrupt=", 8) == 0) {
+            synthetic.corrupt_percent = atof(option + 8);
+        } else if (strncmp(option, "patterns=", 9) == 0) {
+            synthetic.patterns = 0;
+            for (char *name = option + 9, *next; name && *name; name = next) {
+                next = strchr(name, '+');
+                if (next) *next++ = '\0';
+                int pattern = 0;
+                while (pattern < PATTERN_COUNT && strcmp(name, synthetic_pattern_names[pattern]) != 0) pattern++;
+                if (pattern == PATTERN_COUNT) {
+                    log_fatal("Unknown synthetic pattern `%s`; must be one of bars gradient checker noise", name);
+                    return -1;
+                }
+                synthetic.patterns |= 1 << pattern;
+            }
+        } else {
+            log_fatal("Unknown synthetic source option `%s`", option);
+            return -1;
+        }
+    }
+
+    if (!synthetic.patterns) {
+        log_fatal("At least one synthetic pattern is required");
+        return -1;
+    }
+    source_type = SOURCE_SYNTHETIC;
+    return 0;
+}
+
+// Capture traces store every preview buffer together with its timing so a field recording can be replayed through
+// the pipeline later. The layout is native-endian:
+//
+//   TraceHeader | (TraceRecord, data, zero padding to TRACE_ALIGN)* | uint64_t offsets[count] | TraceFooter
+//
+// Each record's data is followed by at least AV_INPUT_BUFFER_PADDING_SIZE zero bytes, so the replay side can hand
+// out pointers into the mapping without copying. A trace without a footer (e.g. after a crash) is indexed by
+// walking the records.
+#define TRACE_MAGIC "WCZTRACE"
+#define TRACE_INDEX_MAGIC "WCZINDEX"
+#define TRACE_VERSION 1
+#define TRACE_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    char camera_model[32];
+    uint64_t reserved[2];
+} TraceHeader;
+
+typedef struct {
+    uint64_t capture_ns;   // monotonic time at which the preview was available, relative to the first record
+    uint64_t transfer_ns;  // time spent fetching the preview from the camera
+    uint32_t size;
+    uint32_t flags;
+    uint64_t reserved;
+} TraceRecord;
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t index_offset;
+    uint64_t reserved;
+} TraceFooter;
+
+struct {
+    int fd;
+    uint64_t offset;
+    uint64_t first_capture_ns;
+    uint64_t* index;
+    uint64_t count;
+    uint64_t capacity;
+} trace_recorder = {.fd = -1};
+
+struct {
+    const char* path;
+    bool realtime;
+    bool loop;
+    uint8_t* map;
+    size_t map_size;
+    AVBufferRef* buf;  // the mapping, for handing records to the decoder without copying them
+    uint64_t* index;
+    bool owns_index;
+    uint64_t count;
+    uint64_t position;
+    uint64_t base_capture_ns;
+    struct timespec base_time;
+} trace_replay = {0};
+
+uint64_t timespec_to_ns(const struct timespec* ts) { return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec; }
+
+int start_trace_recording(const char* path) {
+    trace_recorder.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_recorder.fd < 0) {
+        log_fatal("Failed to open trace file `%s`: %s", path, strerror(errno));
+        return -1;
+    }
+
+    TraceHeader header = {.magic = TRACE_MAGIC, .version = TRACE_VERSION, .header_size = sizeof(TraceHeader)};
+    snprintf(header.camera_model, sizeof(header.camera_model), "%s", camera_model);
+    if (write(trace_recorder.fd, &header, sizeof(header)) != sizeof(header)) {
+        log_fatal("Failed to write trace header: %s", strerror(errno));
+        return -1;
+    }
+    trace_recorder.offset = sizeof(header);
+    log_info("Recording capture trace to %s", path);
+    return 0;
+}
+
+int record_trace_frame(const char* image_data, unsigned long image_data_size, uint64_t capture_ns,
+                       uint64_t transfer_ns) {
+    static const uint8_t zeros[TRACE_ALIGN + AV_INPUT_BUFFER_PADDING_SIZE] = {0};
+
+    if (trace_recorder.count == trace_recorder.capacity) {
+        uint64_t capacity = trace_recorder.capacity ? trace_recorder.capacity * 2 : 1024;
+        uint64_t* index = realloc(trace_recorder.index, capacity * sizeof(uint64_t));
+        if (!index) {
+            log_warn("Failed to grow trace index, recording stopped");
+            return -1;
+        }
+        trace_recorder.index = index;
+        trace_recorder.capacity = capacity;
+    }
+    if (trace_recorder.count == 0) trace_recorder.first_capture_ns = capture_ns;
+
+    TraceRecord record = {.capture_ns = capture_ns - trace_recorder.first_capture_ns,
+                          .transfer_ns = transfer_ns,
+                          .size = image_data_size};
+    size_t unpadded = sizeof(record) + image_data_size + AV_INPUT_BUFFER_PADDING_SIZE;
+    size_t padding = AV_INPUT_BUFFER_PADDING_SIZE + (TRACE_ALIGN - unpadded % TRACE_ALIGN) % TRACE_ALIGN;
+    struct iovec iov[3] = {{&record, sizeof(record)},
+                           {(void*)image_data, image_data_size},
+                           {(void*)zeros, padding}};
+    size_t total = sizeof(record) + image_data_size + padding;
+
+    ssize_t n = writev(trace_recorder.fd, iov, 3);
+    if (n != (ssize_t)total) {
+        log_warn("Failed to write trace record, recording stopped: %s", n < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+
+    trace_recorder.index[trace_recorder.count++] = trace_recorder.offset;
+    trace_recorder.offset += total;
+    return 0;
+}
+
+void stop_trace_recording(void) {
+    if (trace_recorder.fd < 0) return;
+
+    TraceFooter footer = {.magic = TRACE_INDEX_MAGIC,
+                          .count = trace_recorder.count,
+                          .index_offset = trace_recorder.offset};
+    size_t index_size = trace_recorder.count * sizeof(uint64_t);
+    if ((index_size && write(trace_recorder.fd, trace_recorder.index, index_size) != (ssize_t)index_size)
+        || write(trace_recorder.fd, &footer, sizeof(footer)) != sizeof(footer)) {
+        log_warn("Failed to write trace index: %s", strerror(errno));
+    } else {
+        log_info("Recorded %llu frames to the capture trace", (unsigned long long)trace_recorder.count);
+    }
+
+    close(trace_recorder.fd);
+    trace_recorder.fd = -1;
+    free(trace_recorder.index);
+    trace_recorder.index = NULL;
+}
+
+// Whether a record at offset lies whole within the mapping, padding included
+bool trace_record_fits(uint64_t offset) {
+    if (offset < sizeof(TraceHeader) || offset > trace_replay.map_size - sizeof(TraceRecord)) return false;
+    const TraceRecord* record = (const TraceRecord*)(trace_replay.map + offset);
+    uint64_t room = trace_replay.map_size - offset - sizeof(TraceRecord);
+    return (uint64_t)record->size + AV_INPUT_BUFFER_PADDING_SIZE <= room;
+}
+
+// Whether the footer describes an index that fills the space before it and only points at records that fit, so a
+// truncated or corrupt trace is scanned instead
+bool trace_index_valid(const TraceFooter* footer) {
+    if (trace_replay.map_size < sizeof(TraceHeader) + sizeof(TraceFooter)) return false;
+    if (memcmp(footer->magic, TRACE_INDEX_MAGIC, 8) != 0) return false;
+    uint64_t index_end = trace_replay.map_size - sizeof(TraceFooter);
+    if (footer->index_offset < sizeof(TraceHeader) || footer->index_offset > index_end) return false;
+    if (footer->index_offset % sizeof(uint64_t) || (index_end - footer->index_offset) % sizeof(uint64_t)) return false;
+    if (footer->count != (index_end - footer->index_offset) / sizeof(uint64_t)) return false;
+
+    const uint64_t* index = (const uint64_t*)(trace_replay.map + footer->index_offset);
+    for (uint64_t i = 0; i < footer->count; i++) {
+        if (index[i] >= footer->index_offset || !trace_record_fits(index[i])) return false;
+    }
+    return true;
+}
+
+// The mapping outlives the decoders, and is unmapped by cleanup_trace_replay
+void trace_buffer_free(void* opaque, uint8_t* data) {
+    (void)opaque;
+    (void)data;
+}
+
+int init_trace_replay(void) {
+    int fd = open(trace_replay.path, O_RDONLY);
+    if (fd < 0) {
+        log_fatal("Failed to open trace file `%s`: %s", trace_replay.path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(TraceHeader)) {
+        log_fatal("Trace file `%s` is too small", trace_replay.path);
+        close(fd);
+        return -1;
+    }
+
+    trace_replay.map_size = st.st_size;
+    trace_replay.map = mmap(NULL, trace_replay.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (trace_replay.map == MAP_FAILED) {
+        trace_replay.map = NULL;
+        log_fatal("Failed to map trace file `%s`: %s", trace_replay.path, strerror(errno));
+        return -1;
+    }
+    madvise(trace_replay.map, trace_replay.map_size, MADV_SEQUENTIAL);
+    trace_replay.buf = av_buffer_create(trace_replay.map, trace_replay.map_size, trace_buffer_free, NULL,
+                                        AV_BUFFER_FLAG_READONLY);
+    if (!trace_replay.buf) {
+        log_fatal("Failed to wrap trace file `%s`", trace_replay.path);
+        return -1;
+    }
+
+    const TraceHeader* header = (const TraceHeader*)trace_replay.map;
+    if (memcmp(header->magic, TRACE_MAGIC, 8) != 0 || header->version != TRACE_VERSION) {
+        log_fatal("`%s` is not a webcamize capture trace", trace_replay.path);
+        return -1;
+    }
+
+    const TraceFooter* footer = (const TraceFooter*)(trace_replay.map + trace_replay.map_size - sizeof(TraceFooter));
+    if (trace_index_valid(footer)) {
+        trace_replay.index = (uint64_t*)(trace_replay.map + footer->index_offset);
+        trace_replay.count = footer->count;
+    } else {
+        // No usable index, rebuild it by walking the records
+        log_warn("Trace `%s` has no index, scanning records", trace_replay.path);
+        uint64_t capacity = 0;
+        uint64_t offset = header->header_size;
+        while (offset + sizeof(TraceRecord) <= trace_replay.map_size) {
+            const TraceRecord* record = (const TraceRecord*)(trace_replay.map + offset);
+            size_t unpadded = sizeof(TraceRecord) + record->size + AV_INPUT_BUFFER_PADDING_SIZE;
+            uint64_t next = offset + unpadded + (TRACE_ALIGN - unpadded % TRACE_ALIGN) % TRACE_ALIGN;
+            if (next > trace_replay.map_size) break;
+            if (trace_replay.count == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                uint64_t* index = realloc(trace_replay.index, capacity * sizeof(uint64_t));
+                if (!index) {
+                    log_fatal("Failed to allocate trace index");
+                    return -1;
+                }
+                trace_replay.index = index;
+            }
+            trace_replay.index[trace_replay.count++] = offset;
+            offset = next;
+        }
+        trace_replay.owns_index = true;
+    }
+
+    if (trace_replay.count == 0) {
+        log_fatal("Trace `%s` contains no frames", trace_replay.path);
+        return -1;
+    }
+
+    if (*header->camera_model) snprintf(camera_model, sizeof(camera_model), "%.31s", header->camera_model);
+    log_info("Replaying %llu frames recorded from `%s`%s", (unsigned long long)trace_replay.count, camera_model,
+             trace_replay.realtime ? " with original timing" : "");
+    return 0;
+}
+
+int capture_trace(const char** image_data, unsigned long* image_data_size) {
+    if (trace_replay.position == trace_replay.count) {
+        if (!trace_replay.loop) {
+            log_info("End of capture trace reached");
+            return 1;
+        }
+        trace_replay.position = 0;
+    }
+
+    const TraceRecord* record = (const TraceRecord*)(trace_replay.map + trace_replay.index[trace_replay.position]);
+
+    if (trace_replay.realtime) {
+        if (trace_replay.position == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &trace_replay.base_time);
+            trace_replay.base_capture_ns = record->capture_ns;
+        }
+        uint64_t due = timespec_to_ns(&trace_replay.base_time) + (record->capture_ns - trace_replay.base_capture_ns);
+        struct timespec deadline = {.tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+
+    *image_data = (const char*)(record + 1);
+    *image_data_size = record->size;
+    trace_replay.position++;
+    return 0;
+}
+
+void cleanup_trace_replay(void) {
+    if (trace_replay.owns_index) free(trace_replay.index);
+    av_buffer_unref(&trace_replay.buf);
+    if (trace_replay.map) munmap(trace_replay.map, trace_replay.map_size);
+    trace_replay.map = NULL;
+}
+
+// The reference counted buffer a preview lies in, if it lives long enough to be handed to the decoder as it is
+AVBufferRef* preview_buffer(const char* data) {
+    const uint8_t* p = (const uint8_t*)data;
+    if (current_preview && p == current_preview->data) return current_preview->buf;
+    if (trace_replay.buf && p >= trace_replay.map && p < trace_replay.map + trace_replay.map_size) {
+        return trace_replay.buf;
+    }
+    return NULL;
+}
+
+int parse_replay_spec(const char* spec) {
+    static char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", spec);
+
+    // FILE[,realtime][,loop]
+    char* options = strchr(path, ',');
+    if (options) *options++ = '\0';
+    for (char* option = options ? strtok(options, ",") : NULL; option; option = strtok(NULL, ",")) {
+        if (strcmp(option, "realtime") == 0) {
+            trace_replay.realtime = true;
+        } else if (strcmp(option, "loop") == 0) {
+            trace_replay.loop = true;
+        } else {
+            log_fatal("Unknown trace replay option `%s`", option);
+            return -1;
+        }
+    }
+
+    trace_replay.path = path;
+    source_type = SOURCE_TRACE;
+    return 0;
+}
+
+int init_source(void) {
+    switch (source_type) {
+        case SOURCE_SYNTHETIC:
+            return init_synthetic();
+        case SOURCE_TRACE:
+            return init_trace_replay();
+        default:
+            return init_camera();
+    }
+}
+
+// Returns 0 with a new preview, 1 when the source has no more frames and -1 on failure
+int capture_source(const char** image_data, unsigned long* image_data_size) {
+    struct timespec start, end;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    switch (source_type) {
+        case SOURCE_SYNTHETIC:
+            ret = capture_synthetic(image_data, image_data_size);
+            break;
+        case SOURCE_TRACE:
+            ret = capture_trace(image_data, image_data_size);
+            break;
+        default:
+            ret = capture_camera(image_data, image_data_size);
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (ret == 0 && trace_recorder.fd >= 0) {
+        if (record_trace_frame(*image_data, *image_data_size, timespec_to_ns(&end),
+                               timespec_to_ns(&end) - timespec_to_ns(&start))
+            < 0) {
+            stop_trace_recording();
+        }
+    }
+    return ret;
+}
+
+void cleanup_source(void) {
+    switch (source_type) {
+        case SOURCE_SYNTHETIC:
+            cleanup_synthetic();
+            break;
+        case SOURCE_TRACE:
+            cleanup_trace_replay();
+            break;
+        default:
+            cleanup_camera();
+            break;
+    }
+}
+
+volatile bool alive = true;
+void sig_handler(int signo) {
+    if (signo == SIGINT) alive = false;
+    if (signo == SIGUSR1) zoom_percent = FFMIN(zoom_percent + ZOOM_STEP, ZOOM_MAX);
+    if (signo == SIGUSR2) zoom_percent = FFMAX(zoom_percent - ZOOM_STEP, 100);
+}
+
+// --pull: the source is captured on a thread of its own as fast as it delivers, and the main loop only takes the
+// newest preview once the output has room for a frame and one is due. Previews overtaken before they were taken are
+// dropped undecoded, so decoding scales with the output rate rather than the capture rate.
+struct {
+    pthread_t thread;
+    bool started;
+    atomic_bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    PreviewSlot* newest;  // waiting to be taken, holding a reference of its own
+    struct timespec newest_captured;
+    int status;  // 0 while capturing, 1 once the source ran out and -1 if it failed
+    unsigned long captured;
+    unsigned long overtaken;
+} puller = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+void* capture_thread(void* arg) {
+    (void)arg;
+    while (!atomic_load(&puller.stop)) {
+        const char* data;
+        unsigned long size;
+        struct timespec captured;
+        PreviewSlot* slot = NULL;
+        int ret = capture_source(&data, &size);
+        clock_gettime(CLOCK_MONOTONIC, &captured);
+        if (ret == 0) {
+            // Camera previews are already pooled; synthetic and replayed ones are copied in
+            if (captured_preview && (const uint8_t*)data == captured_preview->data) {
+                preview_ref(captured_preview);
+                slot = captured_preview;
+            } else if ((slot = preview_acquire_wait()) && preview_append(slot, (const uint8_t*)data, size) < 0) {
+                preview_unref(slot);
+                slot = NULL;
+                log_fatal("Failed to hold on to a preview");
+                ret = -1;
+            } else if (!slot) {
+                ret = 1;
+            }
+        }
+
+        pthread_mutex_lock(&puller.lock);
+        if (ret == 0) {
+            if (puller.newest) {
+                preview_unref(puller.newest);
+                puller.overtaken++;
+            }
+            puller.newest = slot;
+            puller.newest_captured = captured;
+            puller.captured++;
+        } else {
+            puller.status = ret;
+        }
+        pthread_cond_signal(&puller.ready);
+        pthread_mutex_unlock(&puller.lock);
+        if (ret != 0) break;
+    }
+    return NULL;
+}
+
+int start_puller(void) {
+    // Signals are left to the main thread, so they can't interrupt a capture halfway
+    sigset_t signals, previous;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    int ret = pthread_create(&puller.thread, NULL, capture_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (ret != 0) {
+        log_fatal("Failed to start the capture thread");
+        return -1;
+    }
+    puller.started = true;
+    return 0;
+}
+
+void stop_puller(void) {
+    if (!puller.started) return;
+    atomic_store(&puller.stop, true);
+    atomic_store(&preview_wait_stop, true);
+    pthread_join(puller.thread, NULL);
+    puller.started = false;
+    if (puller.newest) preview_unref(puller.newest);
+    puller.newest = NULL;
+    log_info("Captured %lu previews, %lu of them overtaken before being decoded", puller.captured, puller.overtaken);
+}
+
+// Waits until an output has room for a frame, which is how a consumer asks for one
+void wait_for_output(void) {
+    struct pollfd pfd = {.fd = file_output.fd, .events = POLLOUT};
+#if defined(OS_LINUX)
+    if (pfd.fd == -1) pfd.fd = v4l2_output.fd;
+#endif
+    if (pfd.fd == -1) return;
+    while (alive && poll(&pfd, 1, 100) == 0) {
+        // Not ready yet; the capture thread keeps replacing the newest preview meanwhile
+    }
+}
+
+// Takes the newest preview, or if the last was already taken, waits for one or leaves slot NULL. Returns 0 with or
+// without one, 1 once the source has run out and -1 if it failed.
+int take_newest_preview(PreviewSlot** slot, struct timespec* captured, bool wait) {
+    pthread_mutex_lock(&puller.lock);
+    while (wait && !puller.newest && puller.status == 0 && alive) {
+        // Wake up now and then, since SIGINT doesn't interrupt the wait
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += 100000000L;
+        timeout.tv_sec += timeout.tv_nsec / 1000000000L;
+        timeout.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&puller.ready, &puller.lock, &timeout);
     }
+    int ret = puller.newest ? 0 : puller.status ? puller.status : wait || !alive ? 1 : 0;
+    *slot = puller.newest;
+    if (puller.newest) *captured = puller.newest_captured;
+    puller.newest = NULL;
+    pthread_mutex_unlock(&puller.lock);
+    return ret;
+}
 
-    log_debug("V4L2 device initialized successfully");
-    return 0;
+// --phase-lock: rather than capturing at each output tick, which leaves every frame most of a period old by the time
+// the next replaces it, each capture starts just early enough for its frame to be converted right before the tick.
+// The frame is then held until the tick. The lead is learned from recent capture-plus-convert times, taking a high
+// percentile of them plus a margin, so that a slow frame rarely misses its tick.
+#define PHASE_SAMPLES 64
+#define PHASE_PERCENTILE 95
+#define PHASE_MARGIN_NS 2000000L
+struct {
+    long samples[PHASE_SAMPLES];  // capture-plus-convert times in ns
+    int count;
+    int next;
+    long lead;      // how long before a tick its capture starts
+    uint64_t tick;  // the next output tick, 0 until the first frame
+    unsigned long ticks;
+    unsigned long missed;
+} phase = {0};
+
+int compare_long(const void* a, const void* b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
 }
 
-int setup_v4l2_format(void) {
-    struct v4l2_format fmt;
+// Learns from a frame whose capture started at started, then holds it until its tick
+void phase_hold(const struct timespec* started, long period) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_ns = timespec_to_ns(&now);
+    phase.samples[phase.next] = now_ns - timespec_to_ns(started);
+    phase.next = (phase.next + 1) % PHASE_SAMPLES;
+    if (phase.count < PHASE_SAMPLES) phase.count++;
 
-    memset(&fmt, 0, sizeof(fmt));
-    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    fmt.fmt.pix.width = width;
-    fmt.fmt.pix.height = height;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-    fmt.fmt.pix.field = V4L2_FIELD_NONE;
-    fmt.fmt.pix.bytesperline = width * 2;  // YUYV = 2 bytes per pixel
-    fmt.fmt.pix.sizeimage = width * height * 2;
+    long sorted[PHASE_SAMPLES];
+    memcpy(sorted, phase.samples, phase.count * sizeof(long));
+    qsort(sorted, phase.count, sizeof(long), compare_long);
+    phase.lead = FFMIN(sorted[(phase.count - 1) * PHASE_PERCENTILE / 100] + PHASE_MARGIN_NS, period);
 
-    if (ioctl(v4l2_fd, VIDIOC_S_FMT, &fmt) < 0) {
-        log_fatal("Could not set format for /dev/video%d: %s", v4l2_dev_num, strerror(errno));
-        return -1;
+    if (!phase.tick) {
+        phase.tick = now_ns;
+    } else if (now_ns > phase.tick) {
+        phase.missed++;
+    } else {
+        struct timespec tick = {.tv_sec = phase.tick / 1000000000ULL, .tv_nsec = phase.tick % 1000000000ULL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
     }
+    phase.ticks++;
+    // A frame that missed its tick goes out now, and the ticks it overran are skipped
+    do {
+        phase.tick += period;
+    } while (phase.tick <= now_ns);
+}
 
-    log_debug("V4L2 format set to %dx%d YUYV", width, height);
-    return 0;
+// When the capture for the next tick should start
+struct timespec phase_next_start(void) {
+    uint64_t start = phase.tick - phase.lead;
+    return (struct timespec){.tv_sec = start / 1000000000ULL, .tv_nsec = start % 1000000000ULL};
 }
 
-int write_to_v4l2_device(const uint8_t* data, int data_size) {
-    int n = write(v4l2_fd, data, data_size);
-    if (n < 0) {
-        log_fatal("Failed to write to V4L2 device: %s", strerror(errno));
-        return -1;
-    } else if (n != data_size) {
-        log_warn("Short write to V4L2 device: wrote %d of %d bytes", n, data_size);
+// --steady: with --pull, frames go out on a clock of their own at exactly --fps. A tick that finds no new preview
+// sends the last frame again straight from the output buffer, and buffers are timestamped with their tick, so
+// consumers see an even cadence whatever the camera does.
+struct {
+    uint64_t tick;  // the current output tick, 0 until the first has passed
+    unsigned long repeated;
+    unsigned long skipped;  // ticks passed over because a frame ran past them
+} output_clock = {0};
+
+// Advances to the next output tick and returns when it is due
+struct timespec next_output_tick(long period) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_ns = timespec_to_ns(&now);
+    if (!output_clock.tick) output_clock.tick = now_ns;
+    output_clock.tick += period;
+    while (output_clock.tick <= now_ns) {
+        output_clock.tick += period;
+        output_clock.skipped++;
     }
-    return 0;
+    return (struct timespec){.tv_sec = output_clock.tick / 1000000000ULL, .tv_nsec = output_clock.tick % 1000000000ULL};
 }
-#endif
 
-AVCodecContext* decoder_ctx = NULL;
-const AVCodec* decoder = NULL;
-AVFrame* input_frame = NULL;
-AVFrame* flipped_frame = NULL;
-AVFrame* output_frame = NULL;
-AVPacket* packet_obj = NULL;
-struct SwsContext* sws_ctx = NULL;
-uint8_t* ffmpeg_output_buffer = NULL;
-int ffmpeg_output_buffer_size = 0;
+// --frame-budget: every frame has until its capture time plus the budget to reach the output. Before each stage
+// the frame is checked against what the remaining stages usually take, and one that can't make it is dropped there,
+// before the expensive work, so a CPU spike costs a few frames instead of making every frame after it late as well.
+typedef enum { STAGE_DECODE, STAGE_CONVERT, STAGE_WRITE, STAGE_COUNT } PipelineStage;
 
-int convert_ffmpeg(const char* image_data, unsigned long image_data_size, uint8_t** output_data, int* output_data_size);
+const char* stage_names[STAGE_COUNT] = {"decode", "convert", "write"};
 
-volatile bool alive = true;
-void sig_handler(int signo) {
-    if (signo == SIGINT) alive = false;
+#define STAGE_COST_SMOOTHING 0.1
+#define STAGE_COST_EASING 0.9  // estimates for stages a drop skipped ease off, so a passed spike can't starve frames
+
+struct {
+    long budget_ns;     // 0 when off
+    uint64_t deadline;  // when the frame in flight is no longer worth sending, 0 for none
+    bool late;          // the frame in flight was dropped
+    int stage;          // stage in flight, -1 for none
+    uint64_t stage_start;
+    double cost[STAGE_COUNT];  // smoothed time each stage takes
+    unsigned long dropped[STAGE_COUNT];
+} frame_budget = {.stage = -1};
+
+// Ends the timing of the stage in flight, if any
+void budget_checkpoint(uint64_t now) {
+    if (frame_budget.stage >= 0) {
+        double took = now - frame_budget.stage_start;
+        double* cost = &frame_budget.cost[frame_budget.stage];
+        *cost = *cost ? *cost + STAGE_COST_SMOOTHING * (took - *cost) : took;
+    }
+    frame_budget.stage = -1;
+}
+
+// Gives a frame captured at captured its deadline
+void budget_frame(const struct timespec* captured) {
+    frame_budget.stage = -1;
+    frame_budget.late = false;
+    frame_budget.deadline = frame_budget.budget_ns ? timespec_to_ns(captured) + frame_budget.budget_ns : 0;
+}
+
+// Called before each stage. Returns true, counting the drop against stage, if the frame can no longer finish the
+// remaining stages within its budget.
+bool budget_spent(PipelineStage stage) {
+    if (!frame_budget.deadline) return false;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_ns = timespec_to_ns(&now);
+    budget_checkpoint(now_ns);
+
+    double remaining = 0;
+    for (int s = stage; s < STAGE_COUNT; s++) remaining += frame_budget.cost[s];
+    if (now_ns + remaining <= frame_budget.deadline) {
+        frame_budget.stage = stage;
+        frame_budget.stage_start = now_ns;
+        return false;
+    }
+
+    frame_budget.dropped[stage]++;
+    frame_budget.late = true;
+    for (int s = stage; s < STAGE_COUNT; s++) frame_budget.cost[s] *= STAGE_COST_EASING;
+    log_debug("Dropping a frame at %s, %.1f ms past its budget", stage_names[stage],
+              (now_ns + remaining - frame_budget.deadline) / 1e6);
+    frame_budget.deadline = 0;
+    return true;
+}
+
+// Ends the timing of the stage in flight, so a wait that follows isn't counted as that stage's work
+void budget_pause(void) {
+    if (frame_budget.stage < 0) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    budget_checkpoint(timespec_to_ns(&now));
+}
+
+// Finishes the frame in flight
+void budget_done(void) {
+    budget_pause();
+    frame_budget.deadline = 0;
 }
+
 int cli(int argc, char* argv[]);
 void print_usage(void);
 void print_status(void);
 
 int main(int argc, char* argv[]) {
+#if defined(FLIP_TEST)
+    return flip_test();
+#endif
     int ret = cli(argc, argv);
     if (ret != 0) return ret;
 
     signal(SIGINT, sig_handler);
-
-    Camera* gp2_camera = NULL;
-    CameraFile* gp2_file = NULL;
-    CameraList* gp2_camlist = NULL;
-    GPContext* gp2_context = NULL;
+    signal(SIGUSR1, sig_handler);
+    signal(SIGUSR2, sig_handler);
 
 #if defined(OS_LINUX)
     if (use_v4l2loopback && (geteuid() != 0)) {
@@ -315,132 +3491,14 @@ int main(int argc, char* argv[]) {
     }
 #endif
 
-    // Initialize gPhoto2 context
-    gp2_context = gp_context_new();
-
-    // Create camera object
-    ret = gp_camera_new(&gp2_camera);
-    if (ret < GP_OK) {
-        log_fatal("Failed to instantiate a new camera: %s", gp_result_as_string(ret));
-        goto cleanup;
-    }
-
-    gp_list_new(&gp2_camlist);
-    ret = gp_camera_autodetect(gp2_camlist, gp2_context);
-    if (ret < GP_OK) {
-        log_fatal("Failed to autodetect cameras: %s", gp_result_as_string(ret));
-        goto cleanup;
-    }
-
-    if (gp_list_count(gp2_camlist) < 1) {
-        log_fatal("No cameras detected!");
-        goto cleanup;
-    }
-
-    // If user specified a camera, check if it exists
-    if (*camera_model) {
-        int index = -1;
-        ret = gp_list_find_by_name(gp2_camlist, &index, camera_model);
-        if (ret < GP_OK) {
-            log_warn("Camera '%s' not found, using first detected camera", camera_model);
-            const char* first_camera = NULL;
-            gp_list_get_name(gp2_camlist, 0, &first_camera);
-            snprintf(camera_model, sizeof(camera_model), "%s", first_camera);
-        } else {
-            log_debug("Found requested camera: %s", camera_model);
-            int gp2_camera_index = ret;
-
-            static CameraAbilitiesList* gp2_abilities_list = NULL;
-            ret = gp_abilities_list_new(&gp2_abilities_list);
-            if (ret < GP_OK) {
-                log_fatal("Failed to initialize abilities list: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-            ret = gp_abilities_list_load(gp2_abilities_list, gp2_context);
-            if (ret < GP_OK) {
-                log_fatal("Failed to populate abilities list: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-
-            CameraAbilities gp2_abilities;
-            ret = gp_abilities_list_lookup_model(gp2_abilities_list, camera_model);
-            if (ret < GP_OK) {
-                log_fatal("Lookup failed for specified model: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-            ret = gp_abilities_list_get_abilities(gp2_abilities_list, ret, &gp2_abilities);
-            if (ret < GP_OK) {
-                log_fatal("Failed to get abilities for specified model: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-            ret = gp_camera_set_abilities(gp2_camera, gp2_abilities);
-            if (ret < GP_OK) {
-                log_fatal("Failed to set abilities for specified model: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-
-            static GPPortInfoList* gp2_port_info_list = NULL;
-            ret = gp_port_info_list_new(&gp2_port_info_list);
-            if (ret < GP_OK) {
-                log_fatal("Failed to initialize port info list: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-            ret = gp_port_info_list_load(gp2_port_info_list);
-            if (ret < GP_OK) {
-                log_fatal("Failed to load port info list: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-            ret = gp_port_info_list_count(gp2_port_info_list);
-            if (ret < GP_OK) {
-                log_fatal("Failed to populate count to port info list: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-            const char* gp2_port_path;
-            ret = gp_list_get_value(gp2_camlist, gp2_camera_index, &gp2_port_path);
-            if (ret < GP_OK) {
-                log_fatal("Failed to get port path for specified camera: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-            ret = gp_port_info_list_lookup_path(gp2_port_info_list, gp2_port_path);
-            if (ret < GP_OK) {
-                log_fatal("Lookup failed for the port of the specified camera within the port info list: %s",
-                          gp_result_as_string(ret));
-                goto cleanup;
-            }
-            int gp2_port_info_index = ret;
-            GPPortInfo gp2_port_info;
-            ret = gp_port_info_list_get_info(gp2_port_info_list, gp2_port_info_index, &gp2_port_info);
-            if (ret < GP_OK) {
-                log_fatal("Failed to get info for port from port info list: %s", gp_result_as_string(ret));
-                goto cleanup;
-            }
-
-            ret = gp_camera_set_port_info(gp2_camera, gp2_port_info);
-            if (ret < GP_OK) {
-                log_fatal("Failed to set the port info of the camera to the specified port info: %s",
-                          gp_result_as_string(ret));
-                goto cleanup;
-            }
-        }
-    } else {
-        // No camera specified, use first detected
-        const char* first_camera = NULL;
-        gp_list_get_name(gp2_camlist, 0, &first_camera);
-        snprintf(camera_model, sizeof(camera_model), "%s", first_camera);
-    }
-
-    log_debug("Using camera: %s", camera_model);
+    if (start_logger() < 0) log_warn("Failed to start the logging thread, logging synchronously");
 
-    ret = gp_camera_init(gp2_camera, gp2_context);
-    if (ret < GP_OK) {
-        log_fatal("Failed to autodetect camera: %s", gp_result_as_string(ret));
-        goto cleanup;
-    }
+    ret = init_source();
+    if (ret < 0) goto cleanup;
 
-    ret = gp_file_new(&gp2_file);
-    if (ret < GP_OK) {
-        log_fatal("Failed to create CameraFile: %s", gp_result_as_string(ret));
-        goto cleanup;
+    if (trace_record_path) {
+        ret = start_trace_recording(trace_record_path);
+        if (ret < 0) goto cleanup;
     }
 
 #if defined(OS_LINUX)
@@ -452,14 +3510,20 @@ int main(int argc, char* argv[]) {
 
     if (*v4l2_dev_path) {
         v4l2_need_format_set = true;
-        log_info("Starting webcam `%s` on %s with vertical flip!", camera_model, v4l2_dev_path);
+        log_info("Starting webcam `%s` on %s (orientation: %s)!", camera_model, v4l2_dev_path,
+                 orientation_names[orientation]);
     } else {
-        log_info("Starting webcam `%s` with vertical flip!", camera_model);
+        log_info("Starting webcam `%s` (orientation: %s)!", camera_model, orientation_names[orientation]);
     }
 #else
-    log_info("Starting webcam `%s` with vertical flip!", camera_model);
+    log_info("Starting webcam `%s` (orientation: %s)!", camera_model, orientation_names[orientation]);
 #endif
 
+    if (!no_convert && arena.size) {
+        ret = init_arena();
+        if (ret < 0) goto cleanup;
+    }
+
     if (!no_convert) {
         // Allocate frames
         input_frame = av_frame_alloc();
@@ -479,6 +3543,30 @@ int main(int argc, char* argv[]) {
             log_fatal("Failed to allocate output frame");
             goto cleanup;
         }
+
+        planar_frame = av_frame_alloc();
+        if (!planar_frame) {
+            log_fatal("Failed to allocate planar frame");
+            goto cleanup;
+        }
+
+        region_frame = av_frame_alloc();
+        if (!region_frame) {
+            log_fatal("Failed to allocate region frame");
+            goto cleanup;
+        }
+    }
+
+    if (file_sink != -1) {
+        // Flags are put back on exit, since stdout's are shared with whatever started webcamize
+        file_sink_flags = fcntl(file_sink, F_GETFL);
+        if (file_sink_flags != -1) fcntl(file_sink, F_SETFL, file_sink_flags | O_NONBLOCK);
+        file_output.fd = file_sink;
+    }
+
+    if (pull_mode) {
+        ret = start_puller();
+        if (ret < 0) goto cleanup;
     }
 
     // main loop
@@ -487,42 +3575,101 @@ int main(int argc, char* argv[]) {
     uint8_t* output_data = NULL;
     int output_data_size = 0;
     struct timespec frame_start = {};
+    struct timespec captured_at = {};
     struct timespec frame_end = {};
-    struct timespec sleep_time = {};
     long frame_time = 0;
-    long target_frame_time = 1000000000L / target_fps;
+    long target_frame_time = target_fps > 0 ? 1000000000L / target_fps : 0;
     while (alive) {
         clock_gettime(CLOCK_MONOTONIC, &frame_start);
 
-        ret = gp_camera_capture_preview(gp2_camera, gp2_file, gp2_context);
-        if (ret != GP_OK) {
-            log_fatal("Failed to capture preview: %s\n", gp_result_as_string(ret));
-            break;
+        AllocSnapshot alloc_mark = alloc_audit_mark();
+        if (pull_mode) {
+            wait_for_output();
+            ret = take_newest_preview(&current_preview, &captured_at, !steady_output);
+            if (ret == 0 && current_preview) {
+                image_data = (const char*)current_preview->data;
+                image_data_size = current_preview->size;
+            }
+        } else {
+            ret = capture_source(&image_data, &image_data_size);
+            clock_gettime(CLOCK_MONOTONIC, &captured_at);
+            current_preview = captured_preview;
         }
-        ret = gp_file_get_data_and_size(gp2_file, &image_data, &image_data_size);
-        if (ret != GP_OK) {
-            log_fatal("Failed to get data from camera file: %s\n", gp_result_as_string(ret));
+        if (ret > 0) {
+            ret = 0;
             break;
         }
+        if (ret < 0) break;
+        alloc_audit_capture(alloc_mark);
+        alloc_mark = alloc_audit_mark();
+        budget_frame(&captured_at);
+
+        if (pull_mode && !current_preview) {
+            // Nothing new by this tick, so the last frame goes out again as it is
+            if (!output_frame_ready) goto loop_end;
+            output_clock.repeated++;
+            budget_done();
+            output_data = ffmpeg_output_buffer;
+            output_data_size = output_frame_size;
+            goto emit;
+        }
 
         if (!no_convert) {
             ret = convert_ffmpeg(image_data, image_data_size, &output_data, &output_data_size);
-            if (ret < 0) {
-                log_warn("Failed to convert image to YUYV, using original image data instead");
-                output_data = (uint8_t*)image_data;
-                output_data_size = image_data_size;
+            if (ret < 0 && output_frame_ready) {
+                // The source bytes are no use to a YUYV consumer, so show the last good frame again
+                log_warn("Failed to convert image, repeating the last frame");
+                output_data = ffmpeg_output_buffer;
+                output_data_size = output_frame_size;
+            } else if (ret != 0 && steady_output && frame_budget.late && output_frame_ready) {
+                // Too late to convert, but the tick still gets a frame
+                output_clock.repeated++;
+                output_data = ffmpeg_output_buffer;
+                output_data_size = output_frame_size;
+                ret = 0;
+                goto emit;
+            } else if (ret != 0) {
+                // Held back while the decoder is being tuned, dropped as too late, or nothing good to show yet
+                ret = 0;
+                goto loop_end;
+            } else if (width != locked_width || height != locked_height) {
+                // The first frame, or a new preview size with --on-resize renegotiate
+                if (locked_width) {
+                    log_info("Output size changed from %dx%d to %dx%d", locked_width, locked_height, width, height);
+                }
+                locked_width = width;
+                locked_height = height;
+#if defined(OS_LINUX)
+                if (*v4l2_dev_path) v4l2_need_format_set = true;
+#endif
             }
         } else {
             output_data = (uint8_t*)image_data;
             output_data_size = image_data_size;
         }
 
+    emit:
+        if (phase_lock && target_frame_time > 0) {
+            budget_pause();
+            phase_hold(&frame_start, target_frame_time);
+        }
+        struct timespec stamp = captured_at;
+        if (steady_output && output_clock.tick) {
+            stamp = (struct timespec){.tv_sec = output_clock.tick / 1000000000ULL,
+                                      .tv_nsec = output_clock.tick % 1000000000ULL};
+        }
+        // Under --steady the tick goes out regardless, and the output buffer already holds this frame
+        if (steady_output) {
+            budget_pause();
+        } else if (budget_spent(STAGE_WRITE)) {
+            goto loop_end;
+        }
+
         if (file_sink != -1) {
-            int n = write(file_sink, output_data, output_data_size);
-            if (n != output_data_size) {
+            ret = sink_write(&file_output, output_data, output_data_size, &captured_at, &stamp);
+            if (ret < 0) {
                 ret = errno;
-                log_fatal("Failed to write all data to file sink, wrote %d of %d bytes: %s\n", n, output_data_size,
-                          strerror(errno));
+                log_fatal("Failed to write to file sink: %s", strerror(errno));
                 break;
             }
             goto loop_end;
@@ -531,14 +3678,30 @@ int main(int argc, char* argv[]) {
 #if defined(OS_LINUX)
         if (v4l2_fd > 0) {
             if (v4l2_need_format_set) {
+                // A frame held back in the old format has no place in the new one
+                if (v4l2_output.pending_size) {
+                    v4l2_output.pending_size = 0;
+                    v4l2_output.dropped++;
+                }
                 ret = setup_v4l2_format();
+                if (ret < 0 && v4l2_width) {
+                    // Typically busy because a consumer holds the old format; keep the stream going at that size
+                    log_warn("Could not renegotiate the V4L2 format, rescaling to %dx%d instead", v4l2_width,
+                             v4l2_height);
+                    resize_policy = RESIZE_RESCALE;
+                    locked_width = v4l2_width;
+                    locked_height = v4l2_height;
+                    v4l2_need_format_set = false;
+                    ret = 0;
+                    goto loop_end;
+                }
                 if (ret < 0) {
                     log_fatal("Failed to set V4L2 format");
                     goto cleanup;
                 }
                 v4l2_need_format_set = false;
             }
-            ret = write_to_v4l2_device(output_data, output_data_size);
+            ret = sink_write(&v4l2_output, output_data, output_data_size, &captured_at, &stamp);
             if (ret < 0) {
                 log_fatal("Failed to write to V4L2 device");
                 break;
@@ -547,22 +3710,57 @@ int main(int argc, char* argv[]) {
 #endif
 
     loop_end: {
+        budget_done();
+        if (pull_mode && current_preview) preview_unref(current_preview);
+        current_preview = NULL;
+        alloc_audit_frame(alloc_mark);
         clock_gettime(CLOCK_MONOTONIC, &frame_end);
         frame_time = (frame_end.tv_sec - frame_start.tv_sec) * 1000000000L + (frame_end.tv_nsec - frame_start.tv_nsec);
-        if (frame_time < target_frame_time) {
-            sleep_time.tv_nsec = target_frame_time - frame_time;
-            nanosleep(&sleep_time, NULL);
+        if (steady_output || phase.tick || frame_time < target_frame_time) {
+            // Spend the wait finishing off any frame a sink wasn't ready for; a failing sink fails its next write
+            struct timespec wake = frame_start;
+            wake.tv_nsec += target_frame_time;
+            wake.tv_sec += wake.tv_nsec / 1000000000L;
+            wake.tv_nsec %= 1000000000L;
+            if (phase.tick) wake = phase_next_start();
+            if (steady_output) wake = next_output_tick(target_frame_time);
+            sink_flush(&file_output, &wake);
+#if defined(OS_LINUX)
+            sink_flush(&v4l2_output, &wake);
+#endif
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
         }
     }
     }
 
 cleanup:
     // general
-    if (file_sink) close(file_sink);
+    stop_puller();
+    report_frame_age();
+    if (output_clock.tick) {
+        log_info("Output clock: %lu frames repeated, %lu ticks skipped", output_clock.repeated,
+                 output_clock.skipped);
+    }
+    if (frame_budget.budget_ns) {
+        log_info("Frame budget: dropped %lu at decode, %lu at convert, %lu at write",
+                 frame_budget.dropped[STAGE_DECODE], frame_budget.dropped[STAGE_CONVERT],
+                 frame_budget.dropped[STAGE_WRITE]);
+    }
+    if (phase.ticks) {
+        log_info("Phase lock: captures started %.1f ms ahead of the output ticks, %lu of %lu ticks missed",
+                 phase.lead / 1e6, phase.missed, phase.ticks);
+    }
+    if (file_sink != -1) {
+        sink_report(&file_output);
+        if (file_sink_flags != -1) fcntl(file_sink, F_SETFL, file_sink_flags);
+        if (file_sink != STDOUT_FILENO) close(file_sink);
+    }
 
 #if defined(OS_LINUX)
     // v4l2
     if (v4l2_fd > 0) {
+        sink_report(&v4l2_output);
+        stop_v4l2_streaming();
         close(v4l2_fd);
         v4l2_fd = -1;
     }
@@ -579,254 +3777,771 @@ cleanup:
 
     // ffmpeg
     log_debug("Cleaning up ffmpeg...");
-    if (ffmpeg_output_buffer) av_free(ffmpeg_output_buffer);
-    if (sws_ctx) sws_freeContext(sws_ctx);
+    if (ffmpeg_output_buffer) pipeline_free(ffmpeg_output_buffer);
+    if (planar_buffer) pipeline_free(planar_buffer);
+    if (transpose_tile) pipeline_free(transpose_tile);
+    if (region_buffer) pipeline_free(region_buffer);
+    if (neutral_chroma) pipeline_free(neutral_chroma);
+#if defined(USE_LIBJPEG)
+    cleanup_jpeg_decoder();
+#endif
+    cleanup_sws_cache();
     if (output_frame) av_frame_free(&output_frame);
+    if (planar_frame) av_frame_free(&planar_frame);
+    if (region_frame) av_frame_free(&region_frame);
     if (flipped_frame) av_frame_free(&flipped_frame);
     if (input_frame) av_frame_free(&input_frame);
-    if (decoder_ctx) avcodec_free_context(&decoder_ctx);
+    cleanup_preview_decoders();
     if (packet_obj) av_packet_free(&packet_obj);
+    av_buffer_unref(&packet_buf);
+    if (packet_pool) av_buffer_pool_uninit(&packet_pool);
+    if (decoder_pool) av_buffer_pool_uninit(&decoder_pool);
+    cleanup_preview_pool();
+    cleanup_arena();
 
-    // gphoto
-    log_debug("Cleaning up gphoto2...");
-    if (gp2_camlist) gp_list_free(gp2_camlist);
-    if (gp2_file) gp_file_free(gp2_file);
-    if (gp2_camera) {
-        if (gp2_context) gp_camera_exit(gp2_camera, gp2_context);
-        gp_camera_free(gp2_camera);
+    // source
+    stop_trace_recording();
+    cleanup_source();
+
+    if (alloc_audit_report() < 0) ret = -1;
+
+    log_debug("Exiting, final ret = %d", ret);
+    stop_logger();
+    return ret < 0 ? 1 : 0;
+}
+
+// Walks the marker segments of a JPEG without decoding anything, so truncated or mangled previews (usually from cut
+// off USB transfers) are dropped in microseconds instead of failing partway through a decode. Returns what's wrong,
+// or NULL if the frame looks whole. Anything that doesn't start like a JPEG is left to the decoder.
+const char* check_jpeg(const uint8_t* data, unsigned long size) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return NULL;
+
+    bool frame_header = false;
+    unsigned long pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return "bytes between segments";
+        while (pos < size && data[pos] == 0xFF) pos++;  // fill bytes
+        if (pos + 3 > size) break;
+        uint8_t marker = data[pos++];
+        if (marker == 0xD9) return "end of image before any scan";
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;  // no length
+
+        unsigned int length = data[pos] << 8 | data[pos + 1];
+        if (length < 2 || pos + length > size) return "segment runs past the end";
+
+        // SOF0 to SOF15, apart from DHT, JPG and DAC which share the range
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (length < 8) return "short frame header";
+            unsigned int components = data[pos + 7];
+            if (!(data[pos + 5] << 8 | data[pos + 6]) || components < 1 || components > 4
+                || length != 8 + 3 * components) {
+                return "bad frame header";
+            }
+            frame_header = true;
+        }
+
+        if (marker == 0xDA) {
+            if (!frame_header) return "scan before the frame header";
+            // Entropy-coded data runs up to EOI, which some cameras follow with padding or a trailer of their own.
+            // Inside the scan a 0xFF is always stuffed or a restart marker, so the last FF D9 is the real EOI.
+            for (unsigned long end = size; end >= pos + length + 2; end--) {
+                if (data[end - 2] == 0xFF && data[end - 1] == 0xD9) return NULL;
+            }
+            return "truncated scan";
+        }
+        pos += length;
+    }
+    return "no scan";
+}
+
+// The autotuner holds back the first AUTOTUNE_FRAMES JPEG previews, times every decoder configuration on them and
+// keeps the fastest that decodes within the latency target, preferring full size over DCT downscaling. The choice is
+// saved per camera model, so later starts skip straight to it. Framing and --gray always use libjpeg, so they aren't
+// tuned.
+#define AUTOTUNE_FRAMES 4
+#define AUTOTUNE_RUNS 3
+
+struct {
+    uint8_t* samples[AUTOTUNE_FRAMES];
+    PreviewSlot* slots[AUTOTUNE_FRAMES];  // the pooled preview behind each sample, or NULL for a copy
+    int sizes[AUTOTUNE_FRAMES];
+    int count;
+    bool done;
+} autotune = {0};
+
+// After the sudo re-exec the cache still belongs to the user who ran webcamize, not root
+struct passwd* sudo_user(void) {
+    const char* uid = getenv("SUDO_UID");
+    if (geteuid() != 0 || !uid || !*uid) return NULL;
+    return getpwuid(strtoul(uid, NULL, 10));
+}
+
+// Hands what was created as root under sudo back to the user
+void give_to_sudo_user(const char* path, const struct passwd* user) {
+    if (user && chown(path, user->pw_uid, user->pw_gid) < 0) {
+        log_debug("Failed to hand %s to %s: %s", path, user->pw_name, strerror(errno));
+    }
+}
+
+int decoder_cache_path(char* path, size_t size, bool create) {
+    const char* cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    struct passwd* user = sudo_user();
+    if (user) {
+        snprintf(path, size, "%s/.cache", user->pw_dir);
+    } else if (cache && *cache) {
+        snprintf(path, size, "%s", cache);
+    } else if (home && *home) {
+        snprintf(path, size, "%s/.cache", home);
+    } else {
+        return -1;
+    }
+    if (create && mkdir(path, 0755) == 0) give_to_sudo_user(path, user);
+    size_t len = strlen(path);
+    snprintf(path + len, size - len, "/webcamize");
+    if (create && mkdir(path, 0755) == 0) give_to_sudo_user(path, user);
+    len = strlen(path);
+    snprintf(path + len, size - len, "/decoders");
+    return 0;
+}
+
+// The cache has one `config<TAB>camera model` line per camera
+int load_decoder_choice(void) {
+    char path[PATH_MAX];
+    if (decoder_cache_path(path, sizeof(path), false) < 0) return -1;
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+
+    int choice = -1;
+    char line[128];
+    while (choice < 0 && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char* model = strchr(line, '\t');
+        if (!model || strcmp(model + 1, camera_model) != 0) continue;
+        *model = '\0';
+        for (int i = 0; i < DECODER_CONFIG_COUNT; i++) {
+            if (strcmp(line, decoder_configs[i].name) == 0) choice = i;
+        }
+    }
+    fclose(file);
+    return choice;
+}
+
+void save_decoder_choice(const DecoderConfig* config) {
+    char path[PATH_MAX], temp_path[PATH_MAX + 4];
+    if (decoder_cache_path(path, sizeof(path), true) < 0) return;
+    snprintf(temp_path, sizeof(temp_path), "%s.new", path);
+    FILE* out = fopen(temp_path, "w");
+    if (!out) {
+        log_warn("Failed to save the decoder choice to %s: %s", temp_path, strerror(errno));
+        return;
+    }
+
+    // Keep every other camera's line
+    FILE* in = fopen(path, "r");
+    if (in) {
+        char line[128];
+        while (fgets(line, sizeof(line), in)) {
+            char* model = strchr(line, '\t');
+            size_t len = model ? strcspn(model + 1, "\n") : 0;
+            if (model && len == strlen(camera_model) && strncmp(model + 1, camera_model, len) == 0) continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s\t%s\n", config->name, camera_model);
+    give_to_sudo_user(temp_path, sudo_user());
+    if (fclose(out) != 0 || rename(temp_path, path) < 0) {
+        log_warn("Failed to save the decoder choice to %s: %s", path, strerror(errno));
+        unlink(temp_path);
+    }
+}
+
+// Mean milliseconds per frame for one configuration, or -1 if it can't decode the samples one packet at a time
+double time_decoder_config(const DecoderConfig* config) {
+    const DecoderConfig* previous = decoder_config;
+    AVCodecContext* ctx = NULL;
+    AVFrame* frame = NULL;
+    AVPacket* packet = NULL;
+    double total_ms = -1;
+
+    if (config->backend == BACKEND_FFMPEG) {
+        const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+        ctx = codec ? avcodec_alloc_context3(codec) : NULL;
+        frame = av_frame_alloc();
+        packet = av_packet_alloc();
+        if (!ctx || !frame || !packet) goto end;
+        configure_decoder(ctx, config);
+        if (avcodec_open2(ctx, codec, NULL) < 0) goto end;
+    }
+    decoder_config = config;
+
+    // The first pass warms caches and spins up threads, so it isn't counted
+    struct timespec start = {0}, stop;
+    for (int run = 0; run <= AUTOTUNE_RUNS; run++) {
+        if (run == 1) clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < autotune.count; i++) {
+            int ret;
+            if (config->backend == BACKEND_FFMPEG) {
+                packet->data = autotune.samples[i];
+                packet->size = autotune.sizes[i];
+                ret = avcodec_send_packet(ctx, packet);
+                if (ret >= 0) ret = avcodec_receive_frame(ctx, frame);
+                av_frame_unref(frame);
+            } else {
+#if defined(USE_LIBJPEG)
+                ret = decode_jpeg_region((const char*)autotune.samples[i], autotune.sizes[i], region_frame);
+                if (ret > 0) ret = -1;
+#else
+                ret = -1;
+#endif
+            }
+            if (ret < 0) goto end;
+        }
     }
-    if (gp2_context) gp_context_unref(gp2_context);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    total_ms = ((stop.tv_sec - start.tv_sec) * 1e3 + (stop.tv_nsec - start.tv_nsec) / 1e6)
+               / (AUTOTUNE_RUNS * autotune.count);
 
-    log_debug("Exiting, final ret = %d", ret);
-    return ret < 0 ? 1 : 0;
+end:
+    decoder_config = previous;
+    if (packet) av_packet_free(&packet);
+    if (frame) av_frame_free(&frame);
+    if (ctx) avcodec_free_context(&ctx);
+    return total_ms;
 }
 
-int convert_ffmpeg(const char* image_data,
-                   unsigned long image_data_size,
-                   uint8_t** output_data,
-                   int* output_data_size) {
-    int ret;
+// Returns 1 while previews are held back for tuning and 0 once conversion can go ahead
+int autotune_decoder(const char* data, unsigned long size) {
+    if (autotune.count == 0) {
+        bool jpeg = size >= 2 && (uint8_t)data[0] == 0xFF && (uint8_t)data[1] == 0xD8;
+        if (!jpeg || framing_active() || gray_mode != GRAY_OFF) {
+            autotune.done = true;
+            return 0;
+        }
+        int cached = retune ? -1 : load_decoder_choice();
+        if (cached >= 0) {
+            decoder_config = &decoder_configs[cached];
+            log_info("Using the %s decoder tuned for `%s`", decoder_config->name, camera_model);
+            autotune.done = true;
+            return 0;
+        }
+        log_info("Tuning the decoder for `%s`...", camera_model);
+    }
 
-    if (!decoder_ctx) {
-        AVFormatContext* format_ctx = NULL;
-        AVIOContext* avio_ctx = avio_alloc_context((unsigned char*)av_malloc(image_data_size), image_data_size, 0, NULL,
-                                                   NULL, NULL, NULL);
-        if (!avio_ctx) {
-            log_warn("Failed to create AVIO context");
-            return -1;
+    // Pooled camera previews are held by reference. Other sources' previews are only valid until the next capture,
+    // so those are kept as padded copies.
+    uint8_t* sample;
+    if (current_preview && (const uint8_t*)data == current_preview->data) {
+        preview_ref(current_preview);
+        autotune.slots[autotune.count] = current_preview;
+        sample = current_preview->data;
+    } else {
+        sample = av_malloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!sample) {
+            log_warn("Failed to allocate a tuning sample");
+            autotune.done = true;
+            return 0;
         }
+        memcpy(sample, data, size);
+        memset(sample + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    }
+    autotune.samples[autotune.count] = sample;
+    autotune.sizes[autotune.count] = size;
+    if (++autotune.count < AUTOTUNE_FRAMES) return 1;
 
-        // Copy image data to the AVIO buffer
-        memcpy(avio_ctx->buffer, image_data, image_data_size);
+    double target_ms = latency_target_ms > 0 ? latency_target_ms : 1000.0 / (target_fps > 0 ? target_fps : 60);
+    double times[DECODER_CONFIG_COUNT];
+    int best = -1;      // fastest full-size configuration within the target
+    int fastest = -1;   // fastest full-size configuration
+    int scaled = -1;    // least downscaled, then fastest, configuration within the target
+    for (int i = 0; i < DECODER_CONFIG_COUNT; i++) {
+        const DecoderConfig* config = &decoder_configs[i];
+        times[i] = time_decoder_config(config);
+        log_debug("Decoder %s: %.2f ms per frame", config->name, times[i]);
+        if (times[i] < 0) continue;
 
-        // Allocate format context
-        format_ctx = avformat_alloc_context();
-        if (!format_ctx) {
-            av_free(avio_ctx->buffer);
-            avio_context_free(&avio_ctx);
-            log_warn("Failed to allocate format context");
-            return -1;
+        bool within = times[i] <= target_ms;
+        if (config->downscale == 0) {
+            if (fastest < 0 || times[i] < times[fastest]) fastest = i;
+            if (within && (best < 0 || times[i] < times[best])) best = i;
+        } else if (within
+                   && (scaled < 0 || config->downscale < decoder_configs[scaled].downscale
+                       || (config->downscale == decoder_configs[scaled].downscale && times[i] < times[scaled]))) {
+            scaled = i;
         }
+    }
 
-        // Set the AVIO context
-        format_ctx->pb = avio_ctx;
+    int choice = best >= 0 ? best : scaled >= 0 ? scaled : fastest;
+    if (choice >= 0) {
+        decoder_config = &decoder_configs[choice];
+        if (best < 0 && scaled < 0) {
+            log_warn("No decoder meets the %.1f ms latency target, using the fastest", target_ms);
+        }
+        log_info("Decoding with %s at %.2f ms per frame", decoder_config->name, times[choice]);
+        save_decoder_choice(decoder_config);
+        // Decoders opened for other preview formats meanwhile are reopened with the choice
+        cleanup_preview_decoders();
+    } else {
+        log_warn("Decoder tuning failed, using %s", decoder_config->name);
+    }
 
-        // Open input
-        ret = avformat_open_input(&format_ctx, NULL, NULL, NULL);
-        if (ret < 0) {
-            av_free(avio_ctx->buffer);
-            avio_context_free(&avio_ctx);
-            avformat_free_context(format_ctx);
-            log_warn("Failed to open input: %s", av_err2str(ret));
-            return -1;
+    for (int i = 0; i < autotune.count; i++) {
+        if (autotune.slots[i]) {
+            preview_unref(autotune.slots[i]);
+            autotune.slots[i] = NULL;
+            autotune.samples[i] = NULL;
+        } else {
+            av_freep(&autotune.samples[i]);
         }
+    }
+    autotune.count = 0;
+    autotune.done = true;
+    return 0;
+}
 
-        // Find stream info
-        ret = avformat_find_stream_info(format_ctx, NULL);
-        if (ret < 0) {
-            avformat_close_input(&format_ctx);
-            av_free(avio_ctx->buffer);
-            avio_context_free(&avio_ctx);
-            log_warn("Failed to find stream info: %s", av_err2str(ret));
-            return -1;
+// Previews from one camera normally carry byte-identical DQT and DHT segments. libavcodec's MJPEG decoder keeps the
+// tables it parsed last, so once it holds a set, frames whose tables match are sent without them and the decoder
+// goes straight from the frame header to the scan, skipping the table parsing and Huffman lookup rebuilds.
+#define JPEG_TABLE_SEGMENTS 16
+uint8_t jpeg_tables[4096];  // the DQT and DHT segments the decoder last saw, back to back
+size_t jpeg_tables_size = 0;
+bool jpeg_tables_primed = false;
+
+// Finds the tables in a preview that the decoder already holds, recording them when they are new. Returns how many
+// spans of src to leave out, with 0 meaning the preview goes to the decoder as it is.
+int jpeg_table_spans(const uint8_t* src, unsigned long size, unsigned long spans[JPEG_TABLE_SEGMENTS][2]) {
+    int span_count = 0;
+    size_t tables_size = 0;
+    bool same = jpeg_tables_primed;
+    unsigned long pos = 2;
+    bool scan = false;
+    if (size < 4 || src[0] != 0xFF || src[1] != 0xD8) goto forget;
+
+    while (pos + 4 <= size && !scan) {
+        uint8_t marker = src[pos + 1];
+        if (src[pos] != 0xFF || marker == 0xFF) goto forget;
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            pos += 2;
+            continue;
         }
+        unsigned long length = 2 + (src[pos + 2] << 8 | src[pos + 3]);
+        if (pos + length > size) goto forget;
 
-        // Find the first video stream
-        int stream_index = -1;
-        for (unsigned int i = 0; i < format_ctx->nb_streams; i++) {
-            if (format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
-                stream_index = i;
-                break;
-            }
+        if (marker == 0xDB || marker == 0xC4) {
+            if (span_count == JPEG_TABLE_SEGMENTS || tables_size + length > sizeof(jpeg_tables)) goto forget;
+            same = same && tables_size + length <= jpeg_tables_size
+                   && memcmp(jpeg_tables + tables_size, src + pos, length) == 0;
+            spans[span_count][0] = pos;
+            spans[span_count][1] = pos + length;
+            span_count++;
+            tables_size += length;
         }
+        scan = marker == 0xDA;
+        pos += length;
+    }
+    if (!scan) goto forget;
 
-        if (stream_index == -1) {
-            avformat_close_input(&format_ctx);
-            av_free(avio_ctx->buffer);
-            avio_context_free(&avio_ctx);
-            log_warn("No video stream found");
-            return -1;
+    if (!same || tables_size != jpeg_tables_size || !tables_size) {
+        // New tables go in with the frame, and are what the next frame is compared against
+        jpeg_tables_size = 0;
+        for (int i = 0; i < span_count; i++) {
+            memcpy(jpeg_tables + jpeg_tables_size, src + spans[i][0], spans[i][1] - spans[i][0]);
+            jpeg_tables_size += spans[i][1] - spans[i][0];
         }
+        return 0;
+    }
+    return span_count;
 
-        // Get codec parameters
-        AVCodecParameters* codec_params = format_ctx->streams[stream_index]->codecpar;
+forget:
+    // Whatever tables this frame carries, the decoder will hold them and they weren't recorded
+    jpeg_tables_size = 0;
+    return 0;
+}
 
-        // Find decoder
-        decoder = avcodec_find_decoder(codec_params->codec_id);
-        if (!decoder) {
-            avformat_close_input(&format_ctx);
-            av_free(avio_ctx->buffer);
-            avio_context_free(&avio_ctx);
-            log_warn("Decoder not found for codec ID: %d", codec_params->codec_id);
-            return -1;
-        }
+// Copies a preview into dst without the spans jpeg_table_spans found. Returns the bytes written.
+unsigned long copy_jpeg_packet(uint8_t* dst, const uint8_t* src, unsigned long size,
+                               unsigned long spans[JPEG_TABLE_SEGMENTS][2], int span_count) {
+    unsigned long written = 0, from = 0;
+    for (int i = 0; i < span_count; i++) {
+        memcpy(dst + written, src + from, spans[i][0] - from);
+        written += spans[i][0] - from;
+        from = spans[i][1];
+    }
+    memcpy(dst + written, src + from, size - from);
+    return written + size - from;
+}
 
-        log_debug("Found decoder: %s for format: %s", decoder->name, format_ctx->iformat->name);
+// Finds the codec of a preview none of preview_signatures matched by probing it with libavformat
+enum AVCodecID probe_preview_codec(const char* image_data, unsigned long image_data_size) {
+    int ret;
+    AVFormatContext* format_ctx = NULL;
+    AVIOContext* avio_ctx = avio_alloc_context((unsigned char*)av_malloc(image_data_size), image_data_size, 0, NULL,
+                                               NULL, NULL, NULL);
+    if (!avio_ctx) {
+        log_warn("Failed to create AVIO context");
+        return AV_CODEC_ID_NONE;
+    }
 
-        // Create decoder context
-        decoder_ctx = avcodec_alloc_context3(decoder);
-        if (!decoder_ctx) {
-            avformat_close_input(&format_ctx);
-            av_free(avio_ctx->buffer);
-            avio_context_free(&avio_ctx);
-            log_warn("Could not allocate decoder context");
-            return -1;
-        }
+    // Copy image data to the AVIO buffer
+    memcpy(avio_ctx->buffer, image_data, image_data_size);
 
-        // Copy codec parameters to decoder context
-        ret = avcodec_parameters_to_context(decoder_ctx, codec_params);
-        if (ret < 0) {
-            avformat_close_input(&format_ctx);
-            av_free(avio_ctx->buffer);
-            avio_context_free(&avio_ctx);
-            avcodec_free_context(&decoder_ctx);
-            log_warn("Failed to copy codec parameters to decoder context: %s", av_err2str(ret));
-            return -1;
-        }
+    // Allocate format context
+    format_ctx = avformat_alloc_context();
+    if (!format_ctx) {
+        av_free(avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+        log_warn("Failed to allocate format context");
+        return AV_CODEC_ID_NONE;
+    }
 
-        // Various tweaks for low-latency decoding
-        AVDictionary* opts = NULL;
-        av_dict_set(&opts, "threads", "auto", 0);
-        av_dict_set(&opts, "thread_type", "frame", 0);
-        decoder_ctx->thread_count = 0;
-        decoder_ctx->thread_type = FF_THREAD_FRAME;
-        decoder_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
-        decoder_ctx->flags2 |= AV_CODEC_FLAG2_FAST;
-        decoder_ctx->flags2 |= AV_CODEC_FLAG2_CHUNKS;
-        decoder_ctx->get_buffer2 = avcodec_default_get_buffer2;
-        decoder_ctx->lowres = 0;
-
-        // Try to find a device for hardware acceleration
-        enum AVHWDeviceType type = av_hwdevice_find_type_by_name("auto");
-        if (type != AV_HWDEVICE_TYPE_NONE) {
-            AVBufferRef* hw_device_ctx = NULL;
-            ret = av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0);
-            if (ret >= 0) {
-                decoder_ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
-                av_buffer_unref(&hw_device_ctx);
-            }
-        }
+    // Set the AVIO context
+    format_ctx->pb = avio_ctx;
 
-        // Open decoder
-        ret = avcodec_open2(decoder_ctx, decoder, &opts);
-        if (ret < 0) {
-            avformat_close_input(&format_ctx);
-            av_free(avio_ctx->buffer);
-            avio_context_free(&avio_ctx);
-            avcodec_free_context(&decoder_ctx);
-            log_warn("Could not open decoder: %s", av_err2str(ret));
-            return -1;
-        }
+    // Open input
+    ret = avformat_open_input(&format_ctx, NULL, NULL, NULL);
+    if (ret < 0) {
+        av_free(avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+        avformat_free_context(format_ctx);
+        log_warn("Failed to open input: %s", av_err2str(ret));
+        return AV_CODEC_ID_NONE;
+    }
 
-        // Set image dimensions from decoder context
-        width = decoder_ctx->width;
-        height = decoder_ctx->height;
+    // Find stream info
+    ret = avformat_find_stream_info(format_ctx, NULL);
+    if (ret < 0) {
+        avformat_close_input(&format_ctx);
+        av_free(avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+        log_warn("Failed to find stream info: %s", av_err2str(ret));
+        return AV_CODEC_ID_NONE;
+    }
 
-        log_debug("Image dimensions: %dx%d", width, height);
+    // Find the first video stream
+    int stream_index = -1;
+    for (unsigned int i = 0; i < format_ctx->nb_streams; i++) {
+        if (format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            stream_index = i;
+            break;
+        }
+    }
 
-        // Clean up format context (we only needed it for setup)
+    if (stream_index == -1) {
         avformat_close_input(&format_ctx);
         av_free(avio_ctx->buffer);
         avio_context_free(&avio_ctx);
+        log_warn("No video stream found");
+        return AV_CODEC_ID_NONE;
     }
 
-    if (!packet_obj) packet_obj = av_packet_alloc();
+    enum AVCodecID codec_id = format_ctx->streams[stream_index]->codecpar->codec_id;
+    log_debug("Probed preview format: %s", format_ctx->iformat->name);
 
-    packet_obj->data = (uint8_t*)image_data;
-    packet_obj->size = image_data_size;
+    avformat_close_input(&format_ctx);
+    av_free(avio_ctx->buffer);
+    avio_context_free(&avio_ctx);
+    return codec_id;
+}
 
-    // Send packet to decoder
-    ret = avcodec_send_packet(decoder_ctx, packet_obj);
-    if (ret < 0) {
-        log_warn("Error sending packet to decoder: %s", av_err2str(ret));
-        return -1;
+// Sniffs which codec a preview needs from its magic bytes, probing once for anything unrecognised
+enum AVCodecID sniff_preview_codec(const char* image_data, unsigned long image_data_size) {
+    for (size_t i = 0; i < sizeof(preview_signatures) / sizeof(*preview_signatures); i++) {
+        const PreviewSignature* sig = &preview_signatures[i];
+        if (image_data_size >= (unsigned long)(sig->offset + sig->size)
+            && memcmp(image_data + sig->offset, sig->magic, sig->size) == 0) {
+            return sig->codec_id;
+        }
+    }
+
+    uint8_t head[PREVIEW_HEAD] = {0};
+    memcpy(head, image_data, image_data_size < PREVIEW_HEAD ? image_data_size : PREVIEW_HEAD);
+    previews_sniffed++;
+    int slot = -1;
+    for (int i = 0; i < probed_preview_count; i++) {
+        if (memcmp(probed_previews[i].head, head, PREVIEW_HEAD) != 0) continue;
+        if (probed_previews[i].codec_id != AV_CODEC_ID_NONE || previews_sniffed < probed_previews[i].expires) {
+            return probed_previews[i].codec_id;
+        }
+        slot = i;  // a failure that has expired is probed again in place
+        break;
+    }
+
+    enum AVCodecID codec_id = probe_preview_codec(image_data, image_data_size);
+    if (slot < 0) {
+        slot = probed_preview_next;
+        probed_preview_next = (probed_preview_next + 1) % PREVIEW_FORMATS;
+        if (probed_preview_count < PREVIEW_FORMATS) probed_preview_count++;
+    }
+    memcpy(probed_previews[slot].head, head, PREVIEW_HEAD);
+    probed_previews[slot].codec_id = codec_id;
+    probed_previews[slot].expires = previews_sniffed + PROBE_RETRY_PREVIEWS;
+    return codec_id;
+}
+
+// Returns the decoder kept for codec_id, opening it on first use
+AVCodecContext* preview_decoder(enum AVCodecID codec_id) {
+    int slot = -1;
+    for (int i = 0; i < PREVIEW_FORMATS; i++) {
+        if (preview_decoders[i].ctx && preview_decoders[i].codec_id == codec_id) return preview_decoders[i].ctx;
+        if (!preview_decoders[i].ctx && slot < 0) slot = i;
+    }
+    if (slot < 0) {
+        log_warn("Too many preview formats to keep a decoder for each");
+        return NULL;
     }
 
-    // Receive frame from decoder
-    ret = avcodec_receive_frame(decoder_ctx, input_frame);
+    const AVCodec* codec = avcodec_find_decoder(codec_id);
+    if (!codec) {
+        log_warn("Decoder not found for codec ID: %d", codec_id);
+        return NULL;
+    }
+
+    AVCodecContext* ctx = avcodec_alloc_context3(codec);
+    if (!ctx) {
+        log_warn("Could not allocate decoder context");
+        return NULL;
+    }
+    configure_decoder(ctx, decoder_config);
+    ctx->get_buffer2 = pipeline_get_buffer2;
+
+    int ret = avcodec_open2(ctx, codec, NULL);
     if (ret < 0) {
-        log_warn("Error receiving frame from decoder: %s", av_err2str(ret));
-        return -1;
+        avcodec_free_context(&ctx);
+        log_warn("Could not open decoder: %s", av_err2str(ret));
+        return NULL;
     }
 
-    // Allocate buffer for flipped frame if needed
-    if (!flipped_frame->data[0] || width != input_frame->width || height != input_frame->height) {
-        width = input_frame->width;
-        height = input_frame->height;
-        
-        flipped_frame->format = input_frame->format;
-        flipped_frame->width = width;
-        flipped_frame->height = height;
-        
-        ret = av_frame_get_buffer(flipped_frame, 0);
-        if (ret < 0) {
-            log_warn("Failed to allocate buffer for flipped frame: %s", av_err2str(ret));
-            return -1;
-        }
+    log_debug("Found decoder: %s (%s)", codec->name, decoder_config->name);
+    preview_decoders[slot].codec_id = codec_id;
+    preview_decoders[slot].ctx = ctx;
+    return ctx;
+}
+
+// Decodes a whole preview into input_frame with libavcodec, using the decoder kept for its format
+int decode_ffmpeg(const char* image_data, unsigned long image_data_size) {
+    int ret;
+
+    enum AVCodecID codec_id = sniff_preview_codec(image_data, image_data_size);
+    if (codec_id == AV_CODEC_ID_NONE) return -1;
+    AVCodecContext* ctx = preview_decoder(codec_id);
+    if (!ctx) return -1;
+    if (ctx != decoder_ctx) {
+        if (decoder_ctx) log_info("Preview format changed to %s", ctx->codec->name);
+        // This decoder may not hold the tables jpeg_table_spans last recorded
+        jpeg_tables_primed = false;
+        decoder_ctx = ctx;
     }
 
-    // Perform vertical flip by copying data with reversed line order
-    for (int plane = 0; plane < 4 && input_frame->data[plane]; plane++) {
-        int plane_height = height;
-        if (plane == 1 || plane == 2) {
-            // For chroma planes in YUV formats
-            const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(input_frame->format);
-            if (desc) {
-                plane_height = height >> desc->log2_chroma_h;
+    if (!packet_obj) packet_obj = av_packet_alloc();
+
+    unsigned long spans[JPEG_TABLE_SEGMENTS][2];
+    int span_count = jpeg_table_spans((const uint8_t*)image_data, image_data_size, spans);
+    AVBufferRef* owner = span_count ? NULL : preview_buffer(image_data);
+    if (owner) {
+        // The preview is already padded and reference counted, so the decoder takes a reference to it as it is
+        packet_obj->data = (uint8_t*)image_data;
+        packet_obj->size = image_data_size;
+    } else {
+        // Otherwise it gets a padded copy; a packet without a buffer would make it allocate one every frame
+        if (!packet_pool || image_data_size + AV_INPUT_BUFFER_PADDING_SIZE > packet_pool_size) {
+            // Leave headroom so a slowly growing preview doesn't rebuild the pool every frame
+            av_buffer_unref(&packet_buf);
+            if (packet_pool) av_buffer_pool_uninit(&packet_pool);
+            packet_pool_size = (image_data_size + AV_INPUT_BUFFER_PADDING_SIZE) * 5 / 4;
+            packet_pool = av_buffer_pool_init2(packet_pool_size, NULL, pipeline_buffer_alloc, NULL);
+            if (!packet_pool) {
+                log_warn("Failed to allocate packet pool");
+                return -1;
             }
         }
-        
-        for (int y = 0; y < plane_height; y++) {
-            memcpy(flipped_frame->data[plane] + y * flipped_frame->linesize[plane],
-                   input_frame->data[plane] + (plane_height - 1 - y) * input_frame->linesize[plane],
-                   input_frame->linesize[plane]);
+        if (!packet_buf || !av_buffer_is_writable(packet_buf)) {
+            av_buffer_unref(&packet_buf);
+            packet_buf = av_buffer_pool_get(packet_pool);
+            if (!packet_buf) {
+                log_warn("Failed to get a packet buffer");
+                return -1;
+            }
         }
+        owner = packet_buf;
+        unsigned long packet_size = copy_jpeg_packet(owner->data, (const uint8_t*)image_data, image_data_size, spans,
+                                                     span_count);
+        memset(owner->data + packet_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        packet_obj->data = owner->data;
+        packet_obj->size = packet_size;
     }
 
-    // Initialize/update SwsContext if needed
-    if (!sws_ctx || width != flipped_frame->width || height != flipped_frame->height) {
-        width = flipped_frame->width;
-        height = flipped_frame->height;
+    // Send packet to decoder. The packet only borrows our reference, and lets go of it before it is unreferenced.
+    packet_obj->buf = owner;
+    ret = avcodec_send_packet(decoder_ctx, packet_obj);
+    packet_obj->buf = NULL;
+    av_packet_unref(packet_obj);
+    if (ret >= 0) ret = avcodec_receive_frame(decoder_ctx, input_frame);
+    // After a failure the decoder's tables can't be trusted, so the next frame goes in whole
+    jpeg_tables_primed = ret >= 0 && jpeg_tables_size > 0;
+    if (ret < 0) {
+        log_warn("Error decoding frame: %s", av_err2str(ret));
+        return -1;
+    }
 
-        if (sws_ctx) {
-            sws_freeContext(sws_ctx);
-        }
+    return 0;
+}
 
-        sws_ctx = sws_getContext(width, height, flipped_frame->format, width, height, AV_PIX_FMT_YUYV422,
-                                 SWS_FAST_BILINEAR, NULL, NULL, NULL);
+// --gray: only the luma plane is flipped and packed. Frames without a plain 8-bit luma plane, and zoomed regions that
+// need rescaling, are brought to GRAY8 by swscale first.
+int convert_gray(const AVFrame* frame, bool rescale) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+    bool luma_plane = desc
+                      && !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL
+                                          | AV_PIX_FMT_FLAG_BITSTREAM))
+                      && desc->comp[0].plane == 0 && desc->comp[0].step == 1 && desc->comp[0].offset == 0
+                      && desc->comp[0].depth == 8;
+    bool full_range = frame->color_range == AVCOL_RANGE_JPEG || (desc && !strncmp(desc->name, "yuvj", 4));
+    const uint8_t* luma = frame->data[0];
+    ptrdiff_t luma_linesize = frame->linesize[0];
+    int ret;
 
+    if (!luma_plane || rescale) {
+        ret = attach_frame_buffer(planar_frame, &planar_buffer, &planar_buffer_size, AV_PIX_FMT_GRAY8, framed_width,
+                                  framed_height);
+        if (ret < 0) {
+            log_warn("Failed to allocate luma frame: %s", av_err2str(ret));
+            return -1;
+        }
+        // A luma plane is scaled on its own, as GRAY8
+        struct SwsContext* sws_ctx =
+            get_sws_context(frame->width, frame->height, luma_plane ? AV_PIX_FMT_GRAY8 : frame->format, framed_width,
+                            framed_height, AV_PIX_FMT_GRAY8, SWS_FAST_BILINEAR, full_range);
         if (!sws_ctx) {
             log_warn("Could not initialize SwsContext");
             return -1;
         }
+        ret = sws_scale(sws_ctx, (const uint8_t* const*)frame->data, frame->linesize, 0, frame->height,
+                        planar_frame->data, planar_frame->linesize);
+        if (ret < 0) {
+            log_warn("Failed to convert image: %s", av_err2str(ret));
+            return -1;
+        }
+        luma = planar_frame->data[0];
+        luma_linesize = planar_frame->linesize[0];
+        full_range = false;
+    }
+
+    if (gray_mode == GRAY_GREY) {
+        orient_plane(output_frame->data[0], output_frame->linesize[0], luma, luma_linesize, framed_width,
+                     framed_height, orientation, full_range);
+        return 0;
+    }
+
+    // YUYV with every chroma row pointing at the same neutral row
+    int size = framed_width / 2 + 16;
+    if (size > neutral_chroma_size) {
+        pipeline_free(neutral_chroma);
+        neutral_chroma = pipeline_alloc(size);
+        neutral_chroma_size = neutral_chroma ? size : 0;
+        if (!neutral_chroma) {
+            log_warn("Failed to allocate neutral chroma");
+            return -1;
+        }
+        memset(neutral_chroma, 128, size);
+    }
+    PlanarView view = {
+        .data = {luma, neutral_chroma, neutral_chroma},
+        .linesize = {luma_linesize, 0, 0},
+        .width = framed_width,
+        .height = framed_height,
+        .full_range = full_range,
+    };
+    ret = pack_oriented(&view, output_frame, orientation, output_streaming);
+    if (ret < 0) {
+        log_warn("Failed to orient frame: %s", av_err2str(ret));
+        return -1;
+    }
+    return 0;
+}
+
+int convert_ffmpeg(const char* image_data,
+                   unsigned long image_data_size,
+                   uint8_t** output_data,
+                   int* output_data_size) {
+    AVFrame* frame = input_frame;
+    bool framing = framing_active();
+
+    int ret;
+    const char* problem = check_jpeg((const uint8_t*)image_data, image_data_size);
+    if (problem) {
+        log_warn("Skipping a broken preview: %s", problem);
+        return -1;
+    }
+
+    if (!autotune.done) {
+        ret = autotune_decoder(image_data, image_data_size);
+        if (ret != 0) return ret;
+    }
+    if (budget_spent(STAGE_DECODE)) return 1;
+
+    ret = 1;
+#if defined(USE_LIBJPEG)
+    if (framing || gray_mode != GRAY_OFF || decoder_config->backend == BACKEND_LIBJPEG) {
+        ret = decode_jpeg_region(image_data, image_data_size, region_frame);
+        if (ret == 0) frame = region_frame;
+    }
+#endif
+    if (ret > 0) {
+        ret = decode_ffmpeg(image_data, image_data_size);
+        if (ret == 0 && framing) {
+            // The whole frame was decoded, but flip and pack still only touch the region
+            Rect roi = region_of_interest(input_frame->width, input_frame->height, 1 << decoder_ctx->lowres);
+            input_frame->crop_left = roi.x;
+            input_frame->crop_top = roi.y;
+            input_frame->crop_right = input_frame->width - roi.x - roi.w;
+            input_frame->crop_bottom = input_frame->height - roi.y - roi.h;
+            ret = av_frame_apply_cropping(input_frame, AV_FRAME_CROP_UNALIGNED);
+            if (ret < 0) {
+                log_warn("Failed to crop frame: %s", av_err2str(ret));
+                return -1;
+            }
+        }
+    }
+    if (ret < 0) return -1;
+
+    int source_width = frame->width;
+    int source_height = frame->height;
+    // Nothing about the output has changed yet, so a frame dropped here leaves the last one intact. The flip is only
+    // addressing, so it counts as part of the conversion.
+    if (budget_spent(STAGE_CONVERT)) return 1;
+    ret = update_flip_plan(frame->format, source_width, source_height);
+    if (ret < 0) {
+        log_warn("Cannot flip frames in pixel format %d", frame->format);
+        return -1;
+    }
+    flip_view(&flip_plan, frame, flipped_frame);
+
+    // From here a failure can leave the output buffer resized or half written
+    output_frame_ready = false;
+    bool transposed = orientation_transposes(orientation);
+    if (resize_policy == RESIZE_RESCALE && locked_width) {
+        // Consumers keep the size they were given, whatever size the camera sends
+        framed_width = transposed ? locked_height : locked_width;
+        framed_height = transposed ? locked_width : locked_height;
+    } else if (!framed_width || (!framing && !framed)) {
+        framed_width = source_width;
+        framed_height = source_height;
+    }
+    if (framing) framed = true;
+    bool rescale = source_width != framed_width || source_height != framed_height;
+    width = transposed ? framed_height & ~1 : framed_width;
+    height = transposed ? framed_width : framed_height;
 
-        // Reallocate output buffer if needed
-        int new_size = av_image_get_buffer_size(AV_PIX_FMT_YUYV422, width, height, 1);
+    // Set up the output frame whenever the geometry changes
+    int output_format = gray_mode == GRAY_GREY ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUYV422;
+    if (!ffmpeg_output_buffer || output_frame->width != width || output_frame->height != height) {
+        int new_size = av_image_get_buffer_size(output_format, width, height, 1);
         if (!ffmpeg_output_buffer || new_size > ffmpeg_output_buffer_size) {
             if (ffmpeg_output_buffer) {
-                av_free(ffmpeg_output_buffer);
+                pipeline_free(ffmpeg_output_buffer);
             }
-            ffmpeg_output_buffer = (uint8_t*)av_malloc(new_size);
+            ffmpeg_output_buffer = (uint8_t*)pipeline_alloc(new_size);
             if (!ffmpeg_output_buffer) {
                 log_warn("Failed to reallocate FFmpeg output buffer");
                 return -1;
@@ -834,8 +4549,7 @@ int convert_ffmpeg(const char* image_data,
             ffmpeg_output_buffer_size = new_size;
         }
 
-        // Set up output frame
-        ret = av_image_fill_arrays(output_frame->data, output_frame->linesize, ffmpeg_output_buffer, AV_PIX_FMT_YUYV422,
+        ret = av_image_fill_arrays(output_frame->data, output_frame->linesize, ffmpeg_output_buffer, output_format,
                                    width, height, 1);
         if (ret < 0) {
             log_warn("Failed to set up output frame: %s", av_err2str(ret));
@@ -844,20 +4558,112 @@ int convert_ffmpeg(const char* image_data,
 
         output_frame->width = width;
         output_frame->height = height;
-        output_frame->format = AV_PIX_FMT_YUYV422;
+        output_frame->format = output_format;
+        output_frame_size = new_size;
+        output_streaming = (size_t)new_size > streaming_threshold();
+    }
+
+    if (gray_mode != GRAY_OFF) {
+        ret = convert_gray(frame, rescale);
+        if (ret < 0) return -1;
+        if (output_streaming) stream_fence();
+        goto done;
+    }
+
+    bool upright = orientation == ORIENTATION_NONE || orientation == ORIENTATION_VFLIP;
+    const AVFrame* source = orientation == ORIENTATION_VFLIP ? flipped_frame : frame;
+
+    if (frame->format == AV_PIX_FMT_YUYV422 && frame->color_range != AVCOL_RANGE_JPEG && upright && !rescale) {
+        // Already in the output format, so copy straight into the output buffer. flip_copy flips its source, and
+        // flipping the flipped view gives back the upright frame. Full range YUYV goes through swscale for the range
+        // mapping, since the output is labelled limited range.
+        flip_copy(&flip_plan, output_frame->data, output_frame->linesize,
+                  orientation == ORIENTATION_VFLIP ? frame : flipped_frame, 0, source_height, output_streaming);
+        if (output_streaming) stream_fence();
+        goto done;
+    }
+
+    // Camera JPEGs are full range, either as yuvj formats or tagged through color_range, while webcams are limited
+    bool full_range = frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_YUVJ422P
+                      || frame->color_range == AVCOL_RANGE_JPEG;
+    bool packable = frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUV422P
+                    || frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_YUVJ422P;
+
+    PlanarView view = {.width = framed_width, .height = framed_height};
+    if (packable && !(source_width & 1) && !rescale) {
+        // Plain interleave plus the range mapping, which is all swscale would do for these formats
+        for (int plane = 0; plane < 3; plane++) {
+            view.data[plane] = frame->data[plane];
+            view.linesize[plane] = frame->linesize[plane];
+        }
+        view.chroma_shift = flip_plan.shift[1];
+        view.full_range = full_range;
+    } else if (upright) {
+        // Everything else goes through swscale, with a context from the cache
+        struct SwsContext* sws_ctx = get_sws_context(source_width, source_height, source->format, width, height,
+                                                     AV_PIX_FMT_YUYV422, SWS_FAST_BILINEAR, full_range);
+        if (!sws_ctx) {
+            log_warn("Could not initialize SwsContext");
+            return -1;
+        }
+
+        // Work through the frame in stripes small enough that a stripe's source and output rows stay in cache
+        int stripe = stripe_rows(source, output_frame->linesize[0]);
+        for (int y0 = 0; y0 < source_height; y0 += stripe) {
+            const uint8_t* slice[4] = {NULL};
+            for (int plane = 0; plane < 4; plane++) {
+                slice[plane] = source->data[plane];
+                if (plane < flip_plan.nb_planes) {
+                    slice[plane] += (y0 >> flip_plan.shift[plane]) * source->linesize[plane];
+                }
+            }
+            ret = sws_scale(sws_ctx, slice, source->linesize, y0, FFMIN(stripe, source_height - y0),
+                            output_frame->data, output_frame->linesize);
+            if (ret < 0) {
+                log_warn("Failed to convert image: %s", av_err2str(ret));
+                return -1;
+            }
+        }
+        if (output_streaming) stream_fence();
+        goto done;
+    } else {
+        // Other formats are brought to planar 4:2:2 first so the oriented pack can take them
+        ret = attach_frame_buffer(planar_frame, &planar_buffer, &planar_buffer_size, AV_PIX_FMT_YUV422P,
+                                  framed_width, framed_height);
+        if (ret < 0) {
+            log_warn("Failed to allocate planar frame: %s", av_err2str(ret));
+            return -1;
+        }
+        struct SwsContext* sws_ctx = get_sws_context(source_width, source_height, frame->format, framed_width,
+                                                     framed_height, AV_PIX_FMT_YUV422P, SWS_FAST_BILINEAR, full_range);
+        if (!sws_ctx) {
+            log_warn("Could not initialize SwsContext");
+            return -1;
+        }
+        ret = sws_scale(sws_ctx, (const uint8_t* const*)frame->data, frame->linesize, 0, source_height,
+                        planar_frame->data, planar_frame->linesize);
+        if (ret < 0) {
+            log_warn("Failed to convert image: %s", av_err2str(ret));
+            return -1;
+        }
+        for (int plane = 0; plane < 3; plane++) {
+            view.data[plane] = planar_frame->data[plane];
+            view.linesize[plane] = planar_frame->linesize[plane];
+        }
     }
 
-    // Convert flipped image to YUYV
-    ret = sws_scale(sws_ctx, (const uint8_t* const*)flipped_frame->data, flipped_frame->linesize, 0, height,
-                    output_frame->data, output_frame->linesize);
-    if (ret <= 0) {
-        log_warn("Failed to convert image: %s", av_err2str(ret));
+    ret = pack_oriented(&view, output_frame, orientation, output_streaming);
+    if (ret < 0) {
+        log_warn("Failed to orient frame: %s", av_err2str(ret));
         return -1;
     }
+    if (output_streaming) stream_fence();
 
+done:
     // Set output parameters
     *output_data = ffmpeg_output_buffer;
-    *output_data_size = ffmpeg_output_buffer_size;
+    *output_data_size = output_frame_size;
+    output_frame_ready = true;
 
     return 0;
 }
@@ -867,6 +4673,26 @@ int cli(int argc, char* argv[]) {
         colors_enabled = false;
     }
 
+    // Long-only options
+    enum {
+        OPT_SYNTHETIC = 256,
+        OPT_RECORD_TRACE,
+        OPT_REPLAY_TRACE,
+        OPT_LOCK_MEMORY,
+        OPT_ORIENTATION,
+        OPT_CROP,
+        OPT_ZOOM,
+        OPT_GRAY,
+        OPT_LATENCY_TARGET,
+        OPT_RETUNE,
+        OPT_ON_RESIZE,
+        OPT_OUTPUT_POLICY,
+        OPT_PULL,
+        OPT_PHASE_LOCK,
+        OPT_STEADY,
+        OPT_FRAME_BUDGET,
+    };
+
     static struct option long_options[] = {{"camera", required_argument, 0, 'c'},
                                            {"fps", required_argument, 0, 'p'},
                                            {"file", optional_argument, 0, 'f'},
@@ -877,6 +4703,22 @@ int cli(int argc, char* argv[]) {
                                            {"no-convert", no_argument, 0, 'x'},
                                            {"no-v4l2loopback", no_argument, 0, 'b'},
                                            {"no-color", no_argument, 0, 'o'},
+                                           {"synthetic", required_argument, 0, OPT_SYNTHETIC},
+                                           {"record-trace", required_argument, 0, OPT_RECORD_TRACE},
+                                           {"replay-trace", required_argument, 0, OPT_REPLAY_TRACE},
+                                           {"lock-memory", optional_argument, 0, OPT_LOCK_MEMORY},
+                                           {"orientation", required_argument, 0, OPT_ORIENTATION},
+                                           {"crop", required_argument, 0, OPT_CROP},
+                                           {"zoom", required_argument, 0, OPT_ZOOM},
+                                           {"gray", optional_argument, 0, OPT_GRAY},
+                                           {"latency-target", required_argument, 0, OPT_LATENCY_TARGET},
+                                           {"retune", no_argument, 0, OPT_RETUNE},
+                                           {"on-resize", required_argument, 0, OPT_ON_RESIZE},
+                                           {"output-policy", required_argument, 0, OPT_OUTPUT_POLICY},
+                                           {"pull", no_argument, 0, OPT_PULL},
+                                           {"phase-lock", no_argument, 0, OPT_PHASE_LOCK},
+                                           {"steady", no_argument, 0, OPT_STEADY},
+                                           {"frame-budget", required_argument, 0, OPT_FRAME_BUDGET},
                                            {"version", no_argument, 0, 'v'},
                                            {"help", no_argument, 0, 'h'},
                                            {0, 0, 0, 0}};
@@ -913,7 +4755,14 @@ int cli(int argc, char* argv[]) {
 
             case 'f':
                 if (optarg) {
-                    file_sink = open(optarg, O_RDWR, O_NONBLOCK);
+                    // Only regular files are created or truncated. A FIFO is opened read-write so opening it doesn't
+                    // wait for a reader to attach.
+                    struct stat st;
+                    if (stat(optarg, &st) == 0 && !S_ISREG(st.st_mode)) {
+                        file_sink = open(optarg, O_RDWR);
+                    } else {
+                        file_sink = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                    }
                     if (file_sink < 0) {
                         log_fatal("Failed to open file sink `%s`: %s", optarg, strerror(errno));
                         return 1;
@@ -986,6 +4835,138 @@ int cli(int argc, char* argv[]) {
                 colors_enabled = false;
                 break;
 
+            case OPT_SYNTHETIC:
+                if (parse_synthetic_spec(optarg) < 0) return 1;
+                break;
+
+            case OPT_RECORD_TRACE:
+                trace_record_path = optarg;
+                break;
+
+            case OPT_REPLAY_TRACE:
+                if (parse_replay_spec(optarg) < 0) return 1;
+                break;
+
+            case OPT_LOCK_MEMORY: {
+                long mib = 128;
+                if (optarg) {
+                    char* end;
+                    errno = 0;
+                    mib = strtol(optarg, &end, 10);
+                    if (errno || end == optarg || *end || mib <= 0 || mib > ARENA_MAX_MIB) {
+                        log_fatal("Argument for --lock-memory must be a number of MiB from 1 to %d, got %s",
+                                  ARENA_MAX_MIB, optarg);
+                        return 1;
+                    }
+                }
+                arena.size = (size_t)mib << 20;
+                break;
+            }
+
+            case OPT_ORIENTATION: {
+                int o = 0;
+                while (o < ORIENTATION_COUNT && strcasecmp(optarg, orientation_names[o]) != 0) o++;
+                if (o == ORIENTATION_COUNT) {
+                    log_fatal("Unknown orientation %s; expected none, vflip, hflip, rotate180, rotate90, rotate270 "
+                              "or transpose", optarg);
+                    return 1;
+                }
+                orientation = o;
+                break;
+            }
+
+            case OPT_CROP:
+                if (sscanf(optarg, "%d,%d,%d,%d", &crop.x, &crop.y, &crop.w, &crop.h) != 4 || crop.x < 0
+                    || crop.y < 0 || crop.w < REGION_MIN || crop.h < REGION_MIN) {
+                    log_fatal("Argument for --crop must be X,Y,W,H with a region of at least %dx%d, got %s",
+                              REGION_MIN, REGION_MIN, optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_ZOOM: {
+                double zoom = atof(optarg);
+                if (zoom < 1 || zoom * 100 > ZOOM_MAX) {
+                    log_fatal("Argument for --zoom must be between 1 and %d, got %s", ZOOM_MAX / 100, optarg);
+                    return 1;
+                }
+                zoom_percent = (int)(zoom * 100);
+                break;
+            }
+
+            case OPT_GRAY:
+                if (!optarg || strcasecmp(optarg, "grey") == 0) {
+                    gray_mode = GRAY_GREY;
+                } else if (strcasecmp(optarg, "yuyv") == 0) {
+                    gray_mode = GRAY_YUYV;
+                } else {
+                    log_fatal("Argument for --gray must be GREY or YUYV, got %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_LATENCY_TARGET:
+                latency_target_ms = atof(optarg);
+                if (latency_target_ms <= 0) {
+                    log_fatal("Argument for --latency-target must be a positive number of milliseconds, got %s",
+                              optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_RETUNE:
+                retune = true;
+                break;
+
+            case OPT_ON_RESIZE:
+                if (strcasecmp(optarg, "rescale") == 0) {
+                    resize_policy = RESIZE_RESCALE;
+                } else if (strcasecmp(optarg, "renegotiate") == 0) {
+                    resize_policy = RESIZE_RENEGOTIATE;
+                } else {
+                    log_fatal("Argument for --on-resize must be rescale or renegotiate, got %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_OUTPUT_POLICY:
+                if (strcasecmp(optarg, "drop") == 0) {
+                    output_policy = OUTPUT_DROP;
+                } else if (strcasecmp(optarg, "replace") == 0) {
+                    output_policy = OUTPUT_REPLACE;
+                } else if (strncasecmp(optarg, "block", 5) == 0
+                           && (optarg[5] == '\0'
+                               || (optarg[5] == '=' && (output_deadline_ms = atoi(optarg + 6)) > 0))) {
+                    output_policy = OUTPUT_BLOCK;
+                } else {
+                    log_fatal("Argument for --output-policy must be drop, replace or block[=MS], got %s", optarg);
+                    return 1;
+                }
+                break;
+
+            case OPT_PULL:
+                pull_mode = true;
+                break;
+
+            case OPT_PHASE_LOCK:
+                phase_lock = true;
+                break;
+
+            case OPT_STEADY:
+                steady_output = true;
+                pull_mode = true;
+                break;
+
+            case OPT_FRAME_BUDGET: {
+                double ms = atof(optarg);
+                if (ms <= 0) {
+                    log_fatal("Argument for --frame-budget must be a positive number of milliseconds, got %s", optarg);
+                    return 1;
+                }
+                frame_budget.budget_ns = ms * 1e6;
+                break;
+            }
+
             case '?':
                 // getopt_long already printed an error message
                 print_usage();
@@ -998,6 +4979,20 @@ int cli(int argc, char* argv[]) {
         }
     }
 
+    if (steady_output && target_fps <= 0) {
+        log_warn("--steady needs a non-zero --fps to keep time by, ignoring it");
+        steady_output = false;
+    }
+    if (phase_lock && target_fps <= 0) {
+        log_warn("--phase-lock needs a non-zero --fps to lock to, ignoring it");
+        phase_lock = false;
+    }
+    if (phase_lock && pull_mode) {
+        log_warn("--phase-lock has nothing to time with %s, which captures continuously; ignoring it",
+                 steady_output ? "--steady" : "--pull");
+        phase_lock = false;
+    }
+
     return 0;
 }
 
@@ -1023,7 +5018,32 @@ void print_usage() {
     printf("  -c,  --camera NAME            Specify a camera to use by its name; autodetects by default\n");
     printf("  -f,  --file [PATH]            Output to a file; if no argument is passed, output to stdout\n");
     printf("  -x,  --no-convert             Don't convert from input format before writing\n");
-    printf("  -p,  --fps VALUE              Specify the maximum frames per second (default: 60)\n");
+    printf("  -p,  --fps VALUE              Specify the maximum frames per second (default: 60, 0 for unlimited)\n");
+    printf("       --synthetic SPEC         Replace the camera with generated JPEG test patterns, where SPEC is\n");
+    printf("                                WxH[@FPS][,jitter=MS][,corrupt=PERCENT][,patterns=bars+gradient+...]\n");
+    printf("       --lock-memory[=MIB]      Prefault and lock frame buffers in a region of MIB (default: 128)\n");
+    printf("       --orientation MODE       Orient the picture: none, vflip, hflip, rotate180, rotate90, rotate270,\n");
+    printf("                                transpose (default: vflip)\n");
+    printf("       --crop X,Y,W,H           Only use the W by H region of the picture at X,Y\n");
+    printf("       --zoom FACTOR            Magnify the centre of the picture; SIGUSR1 and SIGUSR2 zoom in and out\n");
+    printf("       --gray[=FORMAT]          Only output luma, as GREY (default) or as YUYV with neutral chroma\n");
+    printf("       --latency-target MS      Decode time the decoder tuner aims for (default: one frame at --fps)\n");
+    printf("       --retune                 Tune the decoder again instead of using the saved choice\n");
+    printf("       --on-resize POLICY       When the camera changes preview size, rescale to the size already\n");
+    printf("                                given to consumers (default) or renegotiate the V4L2 format\n");
+    printf("       --output-policy POLICY   When the output isn't ready for a frame, drop it, replace the frame\n");
+    printf("                                still waiting, or block[=MS] for up to MS (default: one frame)\n");
+    printf("       --pull                   Capture continuously and only decode the newest preview when the\n");
+    printf("                                output is ready for a frame\n");
+    printf("       --phase-lock             Start each capture so its frame is ready just before it is due,\n");
+    printf("                                keeping frames as fresh as possible (needs a non-zero --fps)\n");
+    printf("       --steady                 Output at exactly --fps, repeating the last frame when the camera\n");
+    printf("                                falls behind (implies --pull)\n");
+    printf("       --frame-budget MS        Drop frames that can't reach the output within MS of their capture,\n");
+    printf("                                at whichever stage finds them too late\n");
+    printf("       --record-trace PATH      Record every preview frame and its timing to a capture trace\n");
+    printf("       --replay-trace SPEC      Replay a capture trace instead of using a camera, where SPEC is\n");
+    printf("                                PATH[,realtime][,loop]\n");
 #if defined(OS_LINUX)
     printf("  -d,  --device NUMBER          Specify the /dev/video_ device number to use\n");
     printf("  -b,  --no-v4l2loopback        Disable v4l2loopback module loading and configuration\n");